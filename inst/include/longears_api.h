@@ -0,0 +1,191 @@
+#ifndef __LONGEARS_API_H__
+#define __LONGEARS_API_H__
+
+/* Public C API for longears.
+ *
+ * Packages that wish to use this API should add longears to their LinkingTo
+ * field and have the librabbitmq headers available. Functions are resolved at
+ * runtime with R_GetCCallable(), so longears must be loaded (e.g. imported)
+ * before they are called. */
+
+#include <Rinternals.h> /* for SEXP */
+#include <R_ext/Rdynload.h> /* for R_GetCCallable */
+#include <sys/time.h> /* for struct timeval */
+#include <amqp.h> /* for amqp_envelope_t */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* An amqp_connection object's underlying connection. Connections are not
+ * thread-safe and should only be used on the main R thread. */
+typedef struct connection longears_connection;
+
+/* Unless otherwise noted, the functions below return zero on success or -1 on
+ * failure, in which case a description of the error is written to buffer. */
+
+/* Get the connection for an amqp_connection object (or its "ptr" element), or
+ * NULL if it is invalid or has been destroyed. */
+static inline longears_connection * longears_get_connection(SEXP conn)
+{
+  typedef longears_connection * (*fn_t)(SEXP);
+  static fn_t fn = NULL;
+  if (!fn) {
+    fn = (fn_t) R_GetCCallable("longears", "longears_get_connection");
+  }
+  return fn(conn);
+}
+
+/* Get the librabbitmq connection state and the connection's open channel,
+ * opening a new one if necessary. This provides access to the full librabbitmq
+ * API, but the connection is still owned by longears. It should not be used
+ * directly on connections created with a heartbeat thread. */
+static inline int longears_ensure_channel(longears_connection *conn,
+                                          amqp_connection_state_t *state,
+                                          amqp_channel_t *chan, char *buffer,
+                                          size_t len)
+{
+  typedef int (*fn_t)(longears_connection *, amqp_connection_state_t *,
+                      amqp_channel_t *, char *, size_t);
+  static fn_t fn = NULL;
+  if (!fn) {
+    fn = (fn_t) R_GetCCallable("longears", "longears_ensure_channel");
+  }
+  return fn(conn, state, chan, buffer, len);
+}
+
+/* Publish a message. The properties may be NULL. While the connection is
+ * blocked the message is held back and sent with a later publish. */
+static inline int longears_publish(longears_connection *conn,
+                                   amqp_bytes_t exchange,
+                                   amqp_bytes_t routing_key, amqp_bytes_t body,
+                                   int mandatory, int immediate,
+                                   const amqp_basic_properties_t *props,
+                                   char *buffer, size_t len)
+{
+  typedef int (*fn_t)(longears_connection *, amqp_bytes_t, amqp_bytes_t,
+                      amqp_bytes_t, int, int, const amqp_basic_properties_t *,
+                      char *, size_t);
+  static fn_t fn = NULL;
+  if (!fn) {
+    fn = (fn_t) R_GetCCallable("longears", "longears_publish");
+  }
+  return fn(conn, exchange, routing_key, body, mandatory, immediate, props,
+            buffer, len);
+}
+
+/* Get a single message from a queue. Returns 1 and fills env (which must then
+ * be released with amqp_destroy_envelope()) if there was a message, 0 if the
+ * queue was empty, or -1 on failure. Messages must be acknowledged unless
+ * no_ack is nonzero. */
+static inline int longears_get(longears_connection *conn, amqp_bytes_t queue,
+                               int no_ack, amqp_envelope_t *env, char *buffer,
+                               size_t len)
+{
+  typedef int (*fn_t)(longears_connection *, amqp_bytes_t, int,
+                      amqp_envelope_t *, char *, size_t);
+  static fn_t fn = NULL;
+  if (!fn) {
+    fn = (fn_t) R_GetCCallable("longears", "longears_get");
+  }
+  return fn(conn, queue, no_ack, env, buffer, len);
+}
+
+/* Acknowledge or nack messages received with longears_get() or
+ * longears_consume_message(). */
+static inline int longears_ack(longears_connection *conn, uint64_t delivery_tag,
+                               int multiple, char *buffer, size_t len)
+{
+  typedef int (*fn_t)(longears_connection *, uint64_t, int, char *, size_t);
+  static fn_t fn = NULL;
+  if (!fn) {
+    fn = (fn_t) R_GetCCallable("longears", "longears_ack");
+  }
+  return fn(conn, delivery_tag, multiple, buffer, len);
+}
+
+static inline int longears_nack(longears_connection *conn,
+                                uint64_t delivery_tag, int multiple,
+                                int requeue, char *buffer, size_t len)
+{
+  typedef int (*fn_t)(longears_connection *, uint64_t, int, int, char *,
+                      size_t);
+  static fn_t fn = NULL;
+  if (!fn) {
+    fn = (fn_t) R_GetCCallable("longears", "longears_nack");
+  }
+  return fn(conn, delivery_tag, multiple, requeue, buffer, len);
+}
+
+/* Start a consumer on a queue. The consumer's tag (which may have been
+ * generated by the server) is written to tag_out and must be released with
+ * amqp_bytes_free(). These consumers are not known to R, so their messages
+ * must be read with longears_consume_message() rather than amqp_listen(). */
+static inline int longears_consume(longears_connection *conn,
+                                   amqp_bytes_t queue, amqp_bytes_t tag,
+                                   int no_ack, int exclusive,
+                                   int prefetch_count, amqp_bytes_t *tag_out,
+                                   char *buffer, size_t len)
+{
+  typedef int (*fn_t)(longears_connection *, amqp_bytes_t, amqp_bytes_t, int,
+                      int, int, amqp_bytes_t *, char *, size_t);
+  static fn_t fn = NULL;
+  if (!fn) {
+    fn = (fn_t) R_GetCCallable("longears", "longears_consume");
+  }
+  return fn(conn, queue, tag, no_ack, exclusive, prefetch_count, tag_out,
+            buffer, len);
+}
+
+/* Wait up to timeout (or indefinitely, when NULL) for a message from any
+ * consumer on the connection. Returns 1 and fills env (which must then be
+ * released with amqp_destroy_envelope()) if there was a message, 0 on timeout
+ * or when some other frame (e.g. connection.blocked) was read instead, or -1
+ * on failure. */
+static inline int longears_consume_message(longears_connection *conn,
+                                           struct timeval *timeout,
+                                           amqp_envelope_t *env, char *buffer,
+                                           size_t len)
+{
+  typedef int (*fn_t)(longears_connection *, struct timeval *,
+                      amqp_envelope_t *, char *, size_t);
+  static fn_t fn = NULL;
+  if (!fn) {
+    fn = (fn_t) R_GetCCallable("longears", "longears_consume_message");
+  }
+  return fn(conn, timeout, env, buffer, len);
+}
+
+/* A native message handler for background consumers. It is called on the
+ * consumer's background thread and must not use the R API in any way. Return
+ * zero when the message has been handled (it will be acknowledged if
+ * required) or nonzero to forward it to the consumer's R callback. */
+typedef int (*longears_message_handler)(const amqp_envelope_t *env,
+                                        void *data);
+
+/* Called with the handler's data when it is replaced or the consumer is
+ * destroyed. */
+typedef void (*longears_handler_finalizer)(void *data);
+
+/* Attach a native handler to a consumer created by amqp_consume_later(),
+ * replacing any existing one. Passing a NULL handler detaches it. Returns zero
+ * on success or -1 if the consumer is invalid or has been cancelled. */
+static inline int longears_set_native_handler(SEXP consumer,
+                                              longears_message_handler handler,
+                                              void *data,
+                                              longears_handler_finalizer finalizer)
+{
+  typedef int (*fn_t)(SEXP, longears_message_handler, void *,
+                      longears_handler_finalizer);
+  static fn_t fn = NULL;
+  if (!fn) {
+    fn = (fn_t) R_GetCCallable("longears", "longears_set_native_handler");
+  }
+  return fn(consumer, handler, data, finalizer);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __LONGEARS_API_H__
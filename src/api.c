@@ -0,0 +1,269 @@
+#include <string.h> /* for memcpy, memset */
+
+#include <amqp.h>
+#include <amqp_framing.h>
+
+#include "longears.h"
+#include "connection.h"
+#include "utils.h"
+
+/* Implementations of the C API declared in inst/include/longears_api.h. These
+   mirror the .Call interface, but report errors through a buffer instead of
+   calling Rf_error(), so that they can be used from C++ code safely. Like the
+   .Call interface, they hold the connection's mutex while in use. */
+
+connection * api_get_connection(SEXP conn)
+{
+  if (Rf_inherits(conn, "amqp_connection")) {
+    conn = VECTOR_ELT(conn, 0);
+  }
+  if (TYPEOF(conn) != EXTPTRSXP) {
+    return NULL;
+  }
+  return (connection *) R_ExternalPtrAddr(conn);
+}
+
+int api_ensure_channel(connection *conn, amqp_connection_state_t *state,
+                       amqp_channel_t *chan, char *buffer, size_t len)
+{
+  conn_lock(conn);
+  if (ensure_valid_channel(conn, &conn->chan, buffer, len) < 0) {
+    conn_unlock(conn);
+    return -1;
+  }
+  if (state) *state = conn->conn;
+  if (chan) *chan = conn->chan.chan;
+  conn_unlock(conn);
+  return 0;
+}
+
+/* Hold a message back while the connection is blocked, as R_amqp_publish()
+   does. The pending list holds R objects, so the body and properties are
+   copied into new ones (with the lock released, since allocating can fail). */
+static int api_buffer_publish(connection *conn, amqp_bytes_t exchange,
+                              amqp_bytes_t routing_key, amqp_bytes_t body,
+                              int mandatory, int immediate,
+                              const amqp_basic_properties_t *props,
+                              char *buffer, size_t len)
+{
+  conn_unlock(conn);
+  SEXP body_ = PROTECT(Rf_allocVector(RAWSXP, body.len));
+  if (body.len > 0) memcpy(RAW(body_), body.bytes, body.len);
+  SEXP props_ = R_NilValue;
+  if (props) {
+    SEXP fields = PROTECT(decode_properties(
+      (amqp_basic_properties_t *) props, NULL
+    ));
+    props_ = VECTOR_ELT(R_amqp_encode_properties(fields), 0);
+    UNPROTECT(1);
+  }
+  PROTECT(props_);
+  conn_lock(conn);
+
+  int res = 1;
+  if (conn->blocked) {
+    res = buffer_publish(conn, body_, exchange, routing_key, mandatory,
+                         immediate, props_, buffer, len);
+  }
+  UNPROTECT(2);
+  return res;
+}
+
+int api_publish(connection *conn, amqp_bytes_t exchange,
+                amqp_bytes_t routing_key, amqp_bytes_t body, int mandatory,
+                int immediate, const amqp_basic_properties_t *props,
+                char *buffer, size_t len)
+{
+  conn_lock(conn);
+  if (ensure_valid_channel(conn, &conn->chan, buffer, len) < 0) {
+    conn_unlock(conn);
+    return -1;
+  }
+
+  int res = poll_blocked_state(conn, buffer, len);
+  if (res == 0 && conn->blocked) {
+    res = api_buffer_publish(conn, exchange, routing_key, body, mandatory,
+                             immediate, props, buffer, len);
+    if (res <= 0) {
+      conn_unlock(conn);
+      return res;
+    }
+    /* The connection was unblocked in the meantime. */
+    res = 0;
+  }
+  if (res == 0) {
+    res = flush_publishes(conn, buffer, len);
+  }
+  if (res < 0) {
+    conn_unlock(conn);
+    return -1;
+  }
+
+  int result = amqp_basic_publish(conn->conn, conn->chan.chan, exchange,
+                                  routing_key, mandatory, immediate, props,
+                                  body);
+  if (result != AMQP_STATUS_OK) {
+    render_amqp_library_error(result, conn, &conn->chan, buffer, len);
+    conn_unlock(conn);
+    return -1;
+  }
+
+  amqp_rpc_reply_t reply = amqp_get_rpc_reply(conn->conn);
+  if (reply.reply_type != AMQP_RESPONSE_NORMAL) {
+    render_amqp_error(reply, conn, &conn->chan, buffer, len);
+    conn_unlock(conn);
+    return -1;
+  }
+
+  conn_unlock(conn);
+  return 0;
+}
+
+int api_get(connection *conn, amqp_bytes_t queue, int no_ack,
+            amqp_envelope_t *env, char *buffer, size_t len)
+{
+  conn_lock(conn);
+  if (ensure_valid_channel(conn, &conn->chan, buffer, len) < 0) {
+    conn_unlock(conn);
+    return -1;
+  }
+
+  amqp_maybe_release_buffers_on_channel(conn->conn, conn->chan.chan);
+  amqp_rpc_reply_t reply = amqp_basic_get(conn->conn, conn->chan.chan, queue,
+                                          no_ack);
+  if (reply.reply_type != AMQP_RESPONSE_NORMAL) {
+    render_amqp_error(reply, conn, &conn->chan, buffer, len);
+    conn_unlock(conn);
+    return -1;
+  } else if (reply.reply.id == AMQP_BASIC_GET_EMPTY_METHOD) {
+    conn_unlock(conn);
+    return 0;
+  }
+
+  /* Copy basic_get fields before they are reclaimed. */
+  amqp_basic_get_ok_t *ok = (amqp_basic_get_ok_t *) reply.reply.decoded;
+  memset(env, 0, sizeof(amqp_envelope_t));
+  env->channel = conn->chan.chan;
+  env->consumer_tag = amqp_empty_bytes;
+  env->delivery_tag = ok->delivery_tag;
+  env->redelivered = ok->redelivered;
+  env->exchange = amqp_bytes_malloc_dup(ok->exchange);
+  env->routing_key = amqp_bytes_malloc_dup(ok->routing_key);
+
+  reply = amqp_read_message(conn->conn, conn->chan.chan, &env->message, 0);
+  if (reply.reply_type != AMQP_RESPONSE_NORMAL) {
+    render_amqp_error(reply, conn, &conn->chan, buffer, len);
+    amqp_destroy_envelope(env);
+    conn_unlock(conn);
+    return -1;
+  }
+
+  conn_unlock(conn);
+  return 1;
+}
+
+int api_ack(connection *conn, uint64_t delivery_tag, int multiple,
+            char *buffer, size_t len)
+{
+  conn_lock(conn);
+  if (ensure_valid_channel(conn, &conn->chan, buffer, len) < 0) {
+    conn_unlock(conn);
+    return -1;
+  }
+  int result = amqp_basic_ack(conn->conn, conn->chan.chan, delivery_tag,
+                              multiple);
+  if (result != AMQP_STATUS_OK) {
+    render_amqp_library_error(result, conn, &conn->chan, buffer, len);
+    conn_unlock(conn);
+    return -1;
+  }
+  mark_settled(&conn->chan, delivery_tag, multiple);
+  conn_unlock(conn);
+  return 0;
+}
+
+int api_nack(connection *conn, uint64_t delivery_tag, int multiple,
+             int requeue, char *buffer, size_t len)
+{
+  conn_lock(conn);
+  if (ensure_valid_channel(conn, &conn->chan, buffer, len) < 0) {
+    conn_unlock(conn);
+    return -1;
+  }
+  int result = amqp_basic_nack(conn->conn, conn->chan.chan, delivery_tag,
+                               multiple, requeue);
+  if (result != AMQP_STATUS_OK) {
+    render_amqp_library_error(result, conn, &conn->chan, buffer, len);
+    conn_unlock(conn);
+    return -1;
+  }
+  mark_settled(&conn->chan, delivery_tag, multiple);
+  conn_unlock(conn);
+  return 0;
+}
+
+int api_consume(connection *conn, amqp_bytes_t queue, amqp_bytes_t tag,
+                int no_ack, int exclusive, int prefetch_count,
+                amqp_bytes_t *tag_out, char *buffer, size_t len)
+{
+  conn_lock(conn);
+  if (ensure_valid_channel(conn, &conn->chan, buffer, len) < 0) {
+    conn_unlock(conn);
+    return -1;
+  }
+
+  /* As in R_amqp_create_consumer(), QoS must be set before consuming. */
+  amqp_basic_qos_ok_t *qos_ok = amqp_basic_qos(conn->conn, conn->chan.chan, 0,
+                                               prefetch_count, 0);
+  if (qos_ok == NULL) {
+    amqp_rpc_reply_t reply = amqp_get_rpc_reply(conn->conn);
+    render_amqp_error(reply, conn, &conn->chan, buffer, len);
+    conn_unlock(conn);
+    return -1;
+  }
+
+  amqp_basic_consume_ok_t *consume_ok;
+  consume_ok = amqp_basic_consume(conn->conn, conn->chan.chan, queue, tag, 0,
+                                  no_ack, exclusive, amqp_empty_table);
+  if (consume_ok == NULL) {
+    amqp_rpc_reply_t reply = amqp_get_rpc_reply(conn->conn);
+    render_amqp_error(reply, conn, &conn->chan, buffer, len);
+    conn_unlock(conn);
+    return -1;
+  }
+
+  if (tag_out) {
+    *tag_out = amqp_bytes_malloc_dup(consume_ok->consumer_tag);
+  }
+  /* Stop poll_blocked_state() from reading (and discarding) deliveries. */
+  conn->api_consumers++;
+  conn_unlock(conn);
+  return 0;
+}
+
+int api_consume_message(connection *conn, struct timeval *timeout,
+                        amqp_envelope_t *env, char *buffer, size_t len)
+{
+  conn_lock(conn);
+  if (ensure_valid_channel(conn, &conn->chan, buffer, len) < 0) {
+    conn_unlock(conn);
+    return -1;
+  }
+
+  amqp_maybe_release_buffers(conn->conn);
+  amqp_rpc_reply_t reply = amqp_consume_message(conn->conn, env, timeout, 0);
+  if (reply.reply_type == AMQP_RESPONSE_NORMAL) {
+    conn_unlock(conn);
+    return 1;
+  } else if (reply.reply_type == AMQP_RESPONSE_LIBRARY_EXCEPTION) {
+    /* Read whatever frame got in the way (e.g. connection.blocked), exactly as
+       amqp_listen() does, so that it doesn't wedge later calls. */
+    int res = handle_consume_error(conn, reply.library_error, buffer, len);
+    conn_unlock(conn);
+    return res;
+  }
+
+  render_amqp_error(reply, conn, &conn->chan, buffer, len);
+  conn_unlock(conn);
+  return -1;
+}
@@ -1,5 +1,7 @@
-#include <stdlib.h> /* for calloc, free */
-#include <string.h> /* for strncpy */
+#include <math.h> /* for floor */
+#include <stdio.h> /* for fopen, fwrite, fclose, remove */
+#include <stdlib.h> /* for calloc, free, qsort */
+#include <string.h> /* for strncpy, memcpy */
 
 #include <amqp.h>
 #include <amqp_tcp_socket.h>
@@ -13,8 +15,11 @@ SEXP R_amqp_publish(SEXP ptr, SEXP body, SEXP exchange, SEXP routing_key,
                     SEXP mandatory, SEXP immediate, SEXP props)
 {
   connection *conn = (connection *) R_ExternalPtrAddr(ptr);
+  conn_lock(conn);
   char errbuff[200];
   if (ensure_valid_channel(conn, &conn->chan, errbuff, 200) < 0) {
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to find an open channel. %s", errbuff);
     return R_NilValue;
   }
@@ -31,6 +36,28 @@ SEXP R_amqp_publish(SEXP ptr, SEXP body, SEXP exchange, SEXP routing_key,
     props_ = R_ExternalPtrAddr(props);
   }
 
+  /* Hold messages back while the server has blocked the connection, and send
+     them in order once it is unblocked. */
+  int res = poll_blocked_state(conn, errbuff, 200);
+  if (res == 0 && conn->blocked) {
+    res = buffer_publish(conn, body, exchange_str, routing_key_str,
+                         is_mandatory, is_immediate, props, errbuff, 200);
+    conn_unlock(conn);
+    raise_warnings(conn);
+    if (res < 0) {
+      Rf_error("Failed to publish message. %s", errbuff);
+    }
+    return R_NilValue;
+  }
+  if (res == 0) {
+    res = flush_publishes(conn, errbuff, 200);
+  }
+  if (res < 0) {
+    conn_unlock(conn);
+    raise_warnings(conn);
+    Rf_error("Failed to publish message. %s", errbuff);
+  }
+
   /* Send message. */
 
   int result = amqp_basic_publish(conn->conn, conn->chan.chan,
@@ -40,28 +67,463 @@ SEXP R_amqp_publish(SEXP ptr, SEXP body, SEXP exchange, SEXP routing_key,
 
   if (result != AMQP_STATUS_OK) {
     render_amqp_library_error(result, conn, &conn->chan, errbuff, 200);
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to publish message. %s", errbuff);
   }
 
   amqp_rpc_reply_t reply = amqp_get_rpc_reply(conn->conn);
   if (reply.reply_type != AMQP_RESPONSE_NORMAL) {
     render_amqp_error(reply, conn, &conn->chan, errbuff, 200);
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to publish message. %s", errbuff);
   }
 
+  conn_unlock(conn);
+  raise_warnings(conn);
   return R_NilValue;
 }
 
-SEXP R_amqp_get(SEXP ptr, SEXP queue, SEXP no_ack)
+/* How many messages to publish in a batch between checks for whether the
+   server has blocked the connection. */
+#define BATCH_POLL_INTERVAL 64
+
+/* Publish a batch of messages that share the same properties, except for a
+   handful of per-message overrides. These are patched into a copy of the
+   template for each message rather than encoding the properties from scratch
+   every time. Returns the number of messages sent, which is short of the
+   total if the connection is (or becomes) blocked. */
+SEXP R_amqp_publish_batch(SEXP ptr, SEXP bodies, SEXP exchange,
+                          SEXP routing_key, SEXP mandatory, SEXP immediate,
+                          SEXP props, SEXP overrides)
+{
+  connection *conn = (connection *) R_ExternalPtrAddr(ptr);
+  R_xlen_t n = Rf_xlength(bodies);
+  int key_count = Rf_length(routing_key);
+  int override_count = Rf_length(overrides);
+  SEXP names = Rf_getAttrib(overrides, R_NamesSymbol);
+
+  amqp_basic_properties_t template;
+  template._flags = 0;
+  template.headers.num_entries = 0;
+  if (TYPEOF(props) != NILSXP) {
+    template = *((amqp_basic_properties_t *) R_ExternalPtrAddr(props));
+  }
+
+  /* Sort out where each override goes (and check its type) before touching
+     the connection, since this may fail. Headers that are not already in the
+     template are appended to a copy of its table. */
+  int slot_count = override_count > 0 ? override_count : 1;
+  int flags[slot_count], slots[slot_count];
+  int header_count = template.headers.num_entries;
+  amqp_table_entry_t *entries = (amqp_table_entry_t *) R_alloc(
+    header_count + override_count, sizeof(amqp_table_entry_t)
+  );
+  if (header_count > 0) {
+    memcpy(entries, template.headers.entries,
+           header_count * sizeof(amqp_table_entry_t));
+  }
+
+  int i, j;
+  SEXP elt, name;
+  for (j = 0; j < override_count; j++) {
+    elt = VECTOR_ELT(overrides, j);
+    name = STRING_ELT(names, j);
+    if (Rf_xlength(elt) != n) {
+      Rf_error("Override '%s' must have one value per message.", CHAR(name));
+    }
+    flags[j] = property_flag(name);
+    if (property_bytes(&template, flags[j])) {
+      if (!isString(elt)) Rf_error("'%s' must be a string.", CHAR(name));
+    } else if (flags[j] == 0) {
+      switch (TYPEOF(elt)) {
+      case LGLSXP:
+      case INTSXP:
+      case REALSXP:
+      case STRSXP:
+        break;
+      default:
+        Rf_error("Header '%s' must be an atomic vector.", CHAR(name));
+      }
+      amqp_bytes_t key = charsxp_to_amqp_bytes(name);
+      for (i = 0; i < header_count; i++) {
+        if (entries[i].key.len == key.len &&
+            memcmp(entries[i].key.bytes, key.bytes, key.len) == 0) break;
+      }
+      if (i == header_count) {
+        entries[header_count++].key = key;
+      }
+      slots[j] = i;
+    } else if (!isNumeric(elt)) {
+      Rf_error("'%s' must be numeric.", CHAR(name));
+    }
+  }
+  if (header_count > 0) {
+    template._flags |= AMQP_BASIC_HEADERS_FLAG;
+    template.headers.entries = entries;
+    template.headers.num_entries = header_count;
+  }
+
+  for (i = 0; i < n; i++) {
+    if (TYPEOF(VECTOR_ELT(bodies, i)) != RAWSXP) {
+      Rf_error("Message bodies must be raw vectors.");
+    }
+  }
+
+  conn_lock(conn);
+  char errbuff[200];
+  if (ensure_valid_channel(conn, &conn->chan, errbuff, 200) < 0) {
+    conn_unlock(conn);
+    raise_warnings(conn);
+    Rf_error("Failed to find an open channel. %s", errbuff);
+    return R_NilValue;
+  }
+
+  /* Leave buffering messages for a blocked connection to the caller. */
+  int res = poll_blocked_state(conn, errbuff, 200);
+  if (res == 0 && conn->blocked) {
+    conn_unlock(conn);
+    raise_warnings(conn);
+    return ScalarInteger(0);
+  }
+  if (res == 0) {
+    res = flush_publishes(conn, errbuff, 200);
+  }
+  if (res < 0) {
+    conn_unlock(conn);
+    raise_warnings(conn);
+    Rf_error("Failed to publish message. %s", errbuff);
+  }
+
+  amqp_bytes_t exchange_str = charsxp_to_amqp_bytes(Rf_asChar(exchange));
+  int is_mandatory = asLogical(mandatory);
+  int is_immediate = asLogical(immediate);
+  amqp_bytes_t body_bytes, routing_key_str;
+  amqp_field_value_t *value;
+
+  for (i = 0; i < n; i++) {
+    /* The server can block the connection part of the way through. */
+    if (i > 0 && i % BATCH_POLL_INTERVAL == 0) {
+      if (poll_blocked_state(conn, errbuff, 200) < 0) {
+        conn_unlock(conn);
+        raise_warnings(conn);
+        Rf_error("Failed to publish message %d. %s", i + 1, errbuff);
+      }
+      if (conn->blocked) break;
+    }
+    for (j = 0; j < override_count; j++) {
+      elt = VECTOR_ELT(overrides, j);
+      template._flags |= flags[j];
+      switch (flags[j]) {
+      case 0:
+        value = &entries[slots[j]].value;
+        switch (TYPEOF(elt)) {
+        case LGLSXP:
+          value->kind = AMQP_FIELD_KIND_BOOLEAN;
+          value->value.boolean = LOGICAL(elt)[i];
+          break;
+        case INTSXP:
+          value->kind = AMQP_FIELD_KIND_I32;
+          value->value.i32 = INTEGER(elt)[i];
+          break;
+        case REALSXP:
+          value->kind = AMQP_FIELD_KIND_F64;
+          value->value.f64 = REAL(elt)[i];
+          break;
+        default:
+          value->kind = AMQP_FIELD_KIND_UTF8;
+          value->value.bytes = charsxp_to_amqp_bytes(STRING_ELT(elt, i));
+          break;
+        }
+        break;
+      case AMQP_BASIC_DELIVERY_MODE_FLAG:
+        template.delivery_mode = TYPEOF(elt) == REALSXP ? (int) REAL(elt)[i]
+                                                        : INTEGER(elt)[i];
+        break;
+      case AMQP_BASIC_PRIORITY_FLAG:
+        template.priority = TYPEOF(elt) == REALSXP ? (int) REAL(elt)[i]
+                                                   : INTEGER(elt)[i];
+        break;
+      case AMQP_BASIC_TIMESTAMP_FLAG:
+        template.timestamp = TYPEOF(elt) == REALSXP ? (uint64_t) REAL(elt)[i]
+                                                    : INTEGER(elt)[i];
+        break;
+      default:
+        *property_bytes(&template, flags[j]) =
+          charsxp_to_amqp_bytes(STRING_ELT(elt, i));
+        break;
+      }
+    }
+
+    elt = VECTOR_ELT(bodies, i);
+    body_bytes.len = XLENGTH(elt);
+    body_bytes.bytes = (void *) RAW(elt);
+    routing_key_str = charsxp_to_amqp_bytes(
+      STRING_ELT(routing_key, key_count == 1 ? 0 : i)
+    );
+
+    int result = amqp_basic_publish(conn->conn, conn->chan.chan,
+                                    exchange_str, routing_key_str,
+                                    is_mandatory, is_immediate, &template,
+                                    body_bytes);
+    if (result != AMQP_STATUS_OK) {
+      render_amqp_library_error(result, conn, &conn->chan, errbuff, 200);
+      conn_unlock(conn);
+      raise_warnings(conn);
+      Rf_error("Failed to publish message %d. %s", i + 1, errbuff);
+    }
+  }
+
+  amqp_rpc_reply_t reply = amqp_get_rpc_reply(conn->conn);
+  if (reply.reply_type != AMQP_RESPONSE_NORMAL) {
+    render_amqp_error(reply, conn, &conn->chan, errbuff, 200);
+    conn_unlock(conn);
+    raise_warnings(conn);
+    Rf_error("Failed to publish messages. %s", errbuff);
+  }
+
+  conn_unlock(conn);
+  raise_warnings(conn);
+  return ScalarInteger(i);
+}
+
+#ifdef _WIN32
+#define file_seek _fseeki64
+#define file_tell _ftelli64
+#else
+#define file_seek fseeko
+#define file_tell ftello
+#endif
+
+/* Each body frame carries a 7-byte header and a 1-byte end marker. */
+#define BODY_FRAME_OVERHEAD 8
+
+/* Send a message whose body is read from a file one frame at a time, which is
+   what amqp_basic_publish() does with a body that is already in memory. */
+static int publish_file(connection *conn, FILE *fp, uint64_t size,
+                        amqp_bytes_t exchange, amqp_bytes_t routing_key,
+                        int mandatory, int immediate,
+                        amqp_basic_properties_t *props, char *buffer,
+                        size_t len)
+{
+  amqp_basic_publish_t method;
+  method.ticket = 0;
+  method.exchange = exchange;
+  method.routing_key = routing_key;
+  method.mandatory = mandatory;
+  method.immediate = immediate;
+  int status = amqp_send_method(conn->conn, conn->chan.chan,
+                                AMQP_BASIC_PUBLISH_METHOD, &method);
+  if (status != AMQP_STATUS_OK) {
+    render_amqp_library_error(status, conn, &conn->chan, buffer, len);
+    return -1;
+  }
+
+  amqp_basic_properties_t empty_props;
+  if (!props) {
+    memset(&empty_props, 0, sizeof(empty_props));
+    props = &empty_props;
+  }
+  amqp_frame_t frame;
+  frame.frame_type = AMQP_FRAME_HEADER;
+  frame.channel = conn->chan.chan;
+  frame.payload.properties.class_id = AMQP_BASIC_CLASS;
+  frame.payload.properties.body_size = size;
+  frame.payload.properties.decoded = (void *) props;
+  status = amqp_send_frame(conn->conn, &frame);
+  if (status != AMQP_STATUS_OK) {
+    render_amqp_library_error(status, conn, &conn->chan, buffer, len);
+    return -1;
+  }
+
+  size_t chunk_size = amqp_get_frame_max(conn->conn) - BODY_FRAME_OVERHEAD;
+  void *chunk = malloc(chunk_size);
+  if (!chunk) {
+    snprintf(buffer, len, "Out of memory.");
+    status = AMQP_STATUS_NO_MEMORY;
+  }
+  uint64_t sent = 0;
+  while (status == AMQP_STATUS_OK && sent < size) {
+    size_t want = size - sent < chunk_size ? size - sent : chunk_size;
+    if (fread(chunk, 1, want, fp) != want) {
+      snprintf(buffer, len, "The file was truncated while being read.");
+      status = AMQP_STATUS_BAD_AMQP_DATA;
+      break;
+    }
+    frame.frame_type = AMQP_FRAME_BODY;
+    frame.payload.body_fragment.bytes = chunk;
+    frame.payload.body_fragment.len = want;
+    status = amqp_send_frame(conn->conn, &frame);
+    if (status != AMQP_STATUS_OK) {
+      render_amqp_library_error(status, conn, &conn->chan, buffer, len);
+    }
+    sent += want;
+  }
+  free(chunk);
+
+  if (status != AMQP_STATUS_OK && conn->is_connected) {
+    /* The server is still waiting for the rest of the message, and there is
+       no way to abandon it other than closing the connection. */
+    amqp_connection_close(conn->conn, AMQP_INTERNAL_ERROR);
+    conn->is_connected = 0;
+    conn->chan.is_open = 0;
+  }
+  return status == AMQP_STATUS_OK ? 0 : -1;
+}
+
+SEXP R_amqp_publish_file(SEXP ptr, SEXP path, SEXP exchange,
+                         SEXP routing_key, SEXP mandatory, SEXP immediate,
+                         SEXP props)
+{
+  connection *conn = (connection *) R_ExternalPtrAddr(ptr);
+  if (!conn) {
+    Rf_error("The amqp connection no longer exists.");
+  }
+
+  const char *path_str = CHAR(Rf_asChar(path));
+  FILE *fp = fopen(path_str, "rb");
+  if (!fp) {
+    Rf_error("Failed to publish file. Cannot open '%s'.", path_str);
+  }
+  int64_t size = -1;
+  if (file_seek(fp, 0, SEEK_END) == 0) {
+    size = file_tell(fp);
+    rewind(fp);
+  }
+  if (size < 0) {
+    fclose(fp);
+    Rf_error("Failed to publish file. Cannot determine the size of '%s'.",
+             path_str);
+  }
+
+  amqp_bytes_t exchange_str = charsxp_to_amqp_bytes(Rf_asChar(exchange));
+  amqp_bytes_t routing_key_str = charsxp_to_amqp_bytes(Rf_asChar(routing_key));
+  int is_mandatory = asLogical(mandatory);
+  int is_immediate = asLogical(immediate);
+  amqp_basic_properties_t *props_ = NULL;
+  if (TYPEOF(props) != NILSXP) {
+    props_ = R_ExternalPtrAddr(props);
+  }
+
+  char errbuff[200];
+  conn_lock(conn);
+  if (ensure_valid_channel(conn, &conn->chan, errbuff, 200) < 0) {
+    conn_unlock(conn);
+    fclose(fp);
+    raise_warnings(conn);
+    Rf_error("Failed to find an open channel. %s", errbuff);
+  }
+
+  /* Files are never held back locally, since that would mean reading them
+     into memory. */
+  int res = poll_blocked_state(conn, errbuff, 200);
+  if (res == 0 && conn->blocked) {
+    snprintf(errbuff, 200, "The connection is blocked (%s).",
+             conn->blocked_reason);
+    res = -1;
+  }
+  if (res == 0) {
+    res = flush_publishes(conn, errbuff, 200);
+  }
+  if (res == 0) {
+    res = publish_file(conn, fp, (uint64_t) size, exchange_str,
+                       routing_key_str, is_mandatory, is_immediate, props_,
+                       errbuff, 200);
+  }
+  fclose(fp);
+  if (res < 0) {
+    conn_unlock(conn);
+    raise_warnings(conn);
+    Rf_error("Failed to publish file. %s", errbuff);
+  }
+
+  conn_unlock(conn);
+  raise_warnings(conn);
+  return ScalarReal((double) size);
+}
+
+/* Read a message's content header and body frames, writing the body to a
+   file as each frame arrives rather than assembling it in memory. Buffers are
+   released after every frame, so memory use does not grow with the size of
+   the message. When out is NULL, the body is read and discarded. */
+static int stream_message(connection *conn, channel *chan, FILE *out,
+                          SEXP holder, char *buffer, size_t len)
+{
+  amqp_frame_t frame;
+  uint64_t body_size = 0, received = 0;
+  int have_header = 0, write_failed = 0;
+
+  while (!have_header || received < body_size) {
+    int status = amqp_simple_wait_frame(conn->conn, &frame);
+    if (status != AMQP_STATUS_OK) {
+      render_amqp_library_error(status, conn, chan, buffer, len);
+      return -1;
+    }
+    if (handle_blocked_frame(conn, &frame)) {
+      continue;
+    }
+    if (frame.channel != chan->chan) {
+      snprintf(buffer, len, "Unexpected frame on channel %d.", frame.channel);
+      return -1;
+    }
+
+    if (!have_header) {
+      if (frame.frame_type != AMQP_FRAME_HEADER) {
+        snprintf(buffer, len, "Expected a content header frame.");
+        return -1;
+      }
+      body_size = frame.payload.properties.body_size;
+      /* Decode the properties now, before their memory is released. */
+      amqp_basic_properties_t *props;
+      props = (amqp_basic_properties_t *) frame.payload.properties.decoded;
+      SET_VECTOR_ELT(holder, 0, decode_properties(props, conn));
+      have_header = 1;
+    } else if (frame.frame_type != AMQP_FRAME_BODY) {
+      snprintf(buffer, len, "Expected a content body frame.");
+      return -1;
+    } else {
+      size_t n = frame.payload.body_fragment.len;
+      if (out && !write_failed &&
+          fwrite(frame.payload.body_fragment.bytes, 1, n, out) != n) {
+        /* Keep reading, so that the rest of the message is consumed. */
+        write_failed = 1;
+      }
+      received += n;
+    }
+    amqp_maybe_release_buffers_on_channel(conn->conn, chan->chan);
+  }
+
+  if (write_failed) {
+    snprintf(buffer, len, "Failed to write the message body to disk.");
+    return -1;
+  }
+  return 0;
+}
+
+SEXP R_amqp_get(SEXP ptr, SEXP queue, SEXP no_ack, SEXP file, SEXP ack)
 {
   connection *conn = (connection *) R_ExternalPtrAddr(ptr);
+  conn_lock(conn);
   char errbuff[200];
   if (ensure_valid_channel(conn, &conn->chan, errbuff, 200) < 0) {
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to find an open channel. %s", errbuff);
     return R_NilValue;
   }
   amqp_bytes_t queue_str = charsxp_to_amqp_bytes(Rf_asChar(queue));
   int has_no_ack = asLogical(no_ack);
+  int should_ack = !has_no_ack && asLogical(ack) == 1;
+  int to_file = !Rf_isNull(file);
+  if (to_file && conn->consumers) {
+    /* Consumers' deliveries could be interleaved with the message's frames,
+       and we would have nowhere to put them. */
+    conn_unlock(conn);
+    raise_warnings(conn);
+    Rf_error("Failed to get message. Messages cannot be written to a file on "
+             "connections with active consumers.");
+  }
 
   /* Get message. */
 
@@ -69,109 +531,331 @@ SEXP R_amqp_get(SEXP ptr, SEXP queue, SEXP no_ack)
                                           has_no_ack);
   if (reply.reply_type != AMQP_RESPONSE_NORMAL) {
     render_amqp_error(reply, conn, &conn->chan, errbuff, 200);
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to get message. %s", errbuff);
     return R_NilValue;
   } else if (reply.reply.id == AMQP_BASIC_GET_EMPTY_METHOD) {
+    conn_unlock(conn);
+    raise_warnings(conn);
     return allocVector(STRSXP, 0); // Equivalent to character(0).
   }
 
   /* Read basic_get fields before they are reclaimed. */
   amqp_basic_get_ok_t *ok = (amqp_basic_get_ok_t *) reply.reply.decoded;
-  int delivery_tag = ok->delivery_tag;
+  uint64_t delivery_tag = ok->delivery_tag;
   int redelivered = ok->redelivered;
   amqp_bytes_t exchange = amqp_bytes_malloc_dup(ok->exchange);
   amqp_bytes_t routing_key = amqp_bytes_malloc_dup(ok->routing_key);
   int message_count = ok->message_count;
 
-  amqp_message_t message;
-  reply = amqp_read_message(conn->conn, conn->chan.chan, &message, 0);
-  if (reply.reply_type != AMQP_RESPONSE_NORMAL) {
-    render_amqp_error(reply, conn, &conn->chan, errbuff, 200);
-    amqp_destroy_message(&message);
-    Rf_error("Failed to read message. %s", errbuff);
-  }
+  SEXP out;
+  if (to_file) {
+    const char *path = CHAR(Rf_asChar(file));
+    FILE *fp = fopen(path, "wb");
+    SEXP holder = PROTECT(Rf_allocVector(VECSXP, 1));
+    int result = stream_message(conn, &conn->chan, fp, holder, errbuff, 200);
+    if (!fp && result == 0) {
+      snprintf(errbuff, 200, "Cannot open file '%s'.", path);
+      result = -1;
+    }
+    if (fp && fclose(fp) != 0 && result == 0) {
+      snprintf(errbuff, 200, "Failed to write the message body to disk.");
+      result = -1;
+    }
+    if (result < 0) {
+      if (fp) remove(path);
+      /* Return the message to the queue, if we can. */
+      if (!has_no_ack && conn->chan.is_open) {
+        amqp_basic_nack(conn->conn, conn->chan.chan, delivery_tag, 0, 1);
+      }
+      amqp_bytes_free(exchange);
+      amqp_bytes_free(routing_key);
+      conn_unlock(conn);
+      raise_warnings(conn);
+      Rf_error("Failed to read message. %s", errbuff);
+    }
 
-  // It's possible the message body is not a valid string -- e.g. it's gzipped
-  // or base64 encoded. So we return a raw vector.
+    /* The message refers to the file, rather than holding the body. */
+    SEXP body = PROTECT(Rf_mkString(path));
+    out = R_message_object(body, delivery_tag, redelivered, exchange,
+                           routing_key, message_count, amqp_empty_bytes, NULL,
+                           conn);
+    SET_VECTOR_ELT(out, 6, VECTOR_ELT(holder, 0));
+    UNPROTECT(2);
+    PROTECT(out);
+  } else {
+    amqp_message_t message;
+    reply = amqp_read_message(conn->conn, conn->chan.chan, &message, 0);
+    if (reply.reply_type != AMQP_RESPONSE_NORMAL) {
+      render_amqp_error(reply, conn, &conn->chan, errbuff, 200);
+      amqp_destroy_message(&message);
+      conn_unlock(conn);
+      raise_warnings(conn);
+      Rf_error("Failed to read message. %s", errbuff);
+    }
 
-  SEXP body = PROTECT(Rf_allocVector(RAWSXP, message.body.len));
-  memcpy((void *) RAW(body), message.body.bytes, message.body.len);
+    // It's possible the message body is not a valid string -- e.g. it's
+    // gzipped or base64 encoded. So we return a raw vector.
 
-  SEXP out = PROTECT(R_message_object(body, delivery_tag, redelivered, exchange,
-                                      routing_key, message_count,
-                                      amqp_empty_bytes, &message.properties));
+    SEXP body = PROTECT(Rf_allocVector(RAWSXP, message.body.len));
+    memcpy((void *) RAW(body), message.body.bytes, message.body.len);
 
-  if (!has_no_ack) {
-    int ack = amqp_basic_ack(conn->conn, conn->chan.chan, delivery_tag, 0);
-    if (ack != AMQP_STATUS_OK) {
-      render_amqp_library_error(ack, conn, &conn->chan, errbuff, 200);
-      Rf_warning("Failed to acknowledge message. %s", errbuff);
+    out = R_message_object(body, delivery_tag, redelivered, exchange,
+                           routing_key, message_count, amqp_empty_bytes,
+                           &message.properties, conn);
+    amqp_destroy_message(&message);
+    UNPROTECT(1);
+    PROTECT(out);
+  }
+
+  int acked = AMQP_STATUS_OK;
+  if (should_ack) {
+    acked = amqp_basic_ack(conn->conn, conn->chan.chan, delivery_tag, 0);
+    if (acked == AMQP_STATUS_OK) {
+      mark_settled(&conn->chan, delivery_tag, 0);
+    } else {
+      render_amqp_library_error(acked, conn, &conn->chan, errbuff, 200);
     }
   }
 
-  amqp_destroy_message(&message);
   amqp_bytes_free(exchange);
   amqp_bytes_free(routing_key);
   amqp_maybe_release_buffers_on_channel(conn->conn, conn->chan.chan);
-  UNPROTECT(2);
+  conn_unlock(conn);
+  raise_warnings(conn);
+  if (acked != AMQP_STATUS_OK) {
+    Rf_warning("Failed to acknowledge message. %s", errbuff);
+  }
+  UNPROTECT(1);
+  return out;
+}
+
+/* Delivery tags are 64-bit, so they are passed in from R as doubles (which
+   represent them exactly up to 2^53). */
+static uint64_t *parse_delivery_tags(SEXP tags, R_xlen_t *count)
+{
+  SEXP values = PROTECT(Rf_coerceVector(tags, REALSXP));
+  *count = XLENGTH(values);
+  uint64_t *out = (uint64_t *) R_alloc(*count > 0 ? *count : 1,
+                                       sizeof(uint64_t));
+  for (R_xlen_t i = 0; i < *count; i++) {
+    double tag = REAL(values)[i];
+    if (!R_FINITE(tag) || tag < 1 || tag != floor(tag) ||
+        tag >= 18446744073709551616.0) {
+      UNPROTECT(1);
+      Rf_error("Invalid delivery tag: %g.", tag);
+    }
+    out[i] = (uint64_t) tag;
+  }
+  UNPROTECT(1);
   return out;
 }
 
+static int compare_delivery_tags(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+/* How deliveries are settled. */
+#define SETTLE_ACK 0
+#define SETTLE_NACK 1
+#define SETTLE_REJECT 2
+
+static int settle_one(connection *conn, channel *chan, uint64_t tag,
+                      int multiple, int method, int requeue, int *frames)
+{
+  int result;
+  switch (method) {
+  case SETTLE_NACK:
+    result = amqp_basic_nack(conn->conn, chan->chan, tag, multiple, requeue);
+    break;
+  case SETTLE_REJECT:
+    result = amqp_basic_reject(conn->conn, chan->chan, tag, requeue);
+    break;
+  default:
+    result = amqp_basic_ack(conn->conn, chan->chan, tag, multiple);
+    break;
+  }
+  if (result == AMQP_STATUS_OK) {
+    mark_settled(chan, tag, multiple);
+    (*frames)++;
+  }
+  return result;
+}
+
+/* Settle a set of deliveries. Runs of consecutive tags that pick up where the
+   channel's earlier deliveries have all been settled are sent as a single
+   frame with the "multiple" flag, and the rest are sent one at a time. The
+   number of frames sent is stored in frames. Since basic.reject has no
+   "multiple" flag, rejections are always sent one at a time. */
+static int settle_tags(connection *conn, channel *chan, uint64_t *tags,
+                       R_xlen_t count, int multiple, int method, int requeue,
+                       int *frames)
+{
+  *frames = 0;
+  if (count == 0) return AMQP_STATUS_OK;
+  qsort(tags, count, sizeof(uint64_t), compare_delivery_tags);
+
+  if (multiple) {
+    /* This covers every other tag in the set anyway. */
+    return settle_one(conn, chan, tags[count - 1], 1, method, requeue,
+                      frames);
+  }
+
+  R_xlen_t i = 0;
+  while (i < count) {
+    /* Find the end of this run, skipping duplicates. */
+    R_xlen_t j = i;
+    while (j + 1 < count && tags[j + 1] <= tags[j] + 1) j++;
+
+    int result;
+    if (method != SETTLE_REJECT && j > i && tags[i] == chan->settled + 1) {
+      result = settle_one(conn, chan, tags[j], 1, method, requeue, frames);
+      if (result != AMQP_STATUS_OK) return result;
+    } else {
+      for (R_xlen_t k = i; k <= j; k++) {
+        if (k > i && tags[k] == tags[k - 1]) continue;
+        result = settle_one(conn, chan, tags[k], 0, method, requeue,
+                            frames);
+        if (result != AMQP_STATUS_OK) return result;
+      }
+    }
+    i = j + 1;
+  }
+  return AMQP_STATUS_OK;
+}
+
 SEXP R_amqp_ack_on_channel(SEXP ptr, SEXP chan_ptr, SEXP delivery_tag,
                            SEXP multiple)
 {
+  R_xlen_t count;
+  uint64_t *tags = parse_delivery_tags(delivery_tag, &count);
+  int multiple_ = asLogical(multiple) == 1;
+
   connection *conn = (connection *) R_ExternalPtrAddr(ptr);
-  channel *chan = (channel *) R_ExternalPtrAddr(chan_ptr);
+  conn_lock(conn);
+  /* Without a channel, settle messages from amqp_get(). */
+  channel *chan = NULL;
+  if (Rf_isNull(chan_ptr)) {
+    chan = conn ? &conn->chan : NULL;
+  } else {
+    chan = (channel *) R_ExternalPtrAddr(chan_ptr);
+  }
   if (!conn || !chan) {
+    conn_unlock(conn);
     Rf_error("Failed to acknowledge message(s). Invalid connection or channel object.");
   }
   if (!conn->is_connected) {
     chan->is_open = 0;
+    conn_unlock(conn);
     Rf_error("Failed to acknowledge message(s). Not connected to a server.");
   }
   if (!chan->is_open) {
+    conn_unlock(conn);
     Rf_error("Failed to acknowledge message(s). Channel is closed.");
   }
-  int delivery_tag_ = asInteger(delivery_tag);
-  int multiple_ = asLogical(multiple);
 
-  int result = amqp_basic_ack(conn->conn, chan->chan, delivery_tag_,
-                              multiple_);
+  int frames;
+  int result = settle_tags(conn, chan, tags, count, multiple_, SETTLE_ACK, 0,
+                           &frames);
   if (result != AMQP_STATUS_OK) {
     char errbuff[200];
     render_amqp_library_error(result, conn, &conn->chan, errbuff, 200);
+    conn_unlock(conn);
     Rf_error("Failed to acknowledge message(s). %s", errbuff);
   }
 
-  return R_NilValue;
+  conn_unlock(conn);
+  return ScalarInteger(frames);
 }
 
 SEXP R_amqp_nack_on_channel(SEXP ptr, SEXP chan_ptr, SEXP delivery_tag,
                             SEXP multiple, SEXP requeue)
 {
+  R_xlen_t count;
+  uint64_t *tags = parse_delivery_tags(delivery_tag, &count);
+  int multiple_ = asLogical(multiple) == 1;
+  int requeue_ = asLogical(requeue) == 1;
+
   connection *conn = (connection *) R_ExternalPtrAddr(ptr);
-  channel *chan = (channel *) R_ExternalPtrAddr(chan_ptr);
+  conn_lock(conn);
+  /* Without a channel, settle messages from amqp_get(). */
+  channel *chan = NULL;
+  if (Rf_isNull(chan_ptr)) {
+    chan = conn ? &conn->chan : NULL;
+  } else {
+    chan = (channel *) R_ExternalPtrAddr(chan_ptr);
+  }
   if (!conn || !chan) {
+    conn_unlock(conn);
     Rf_error("Failed to nack message(s). Invalid connection or channel object.");
   }
   if (!conn->is_connected) {
     chan->is_open = 0;
+    conn_unlock(conn);
     Rf_error("Failed to nack message(s). Not connected to a server.");
   }
   if (!chan->is_open) {
+    conn_unlock(conn);
     Rf_error("Failed to nack message(s). Channel is closed.");
   }
-  int delivery_tag_ = asInteger(delivery_tag);
-  int multiple_ = asLogical(multiple);
-  int requeue_ = asLogical(requeue);
 
-  int result = amqp_basic_nack(conn->conn, chan->chan, delivery_tag_,
-                               multiple_, requeue_);
+  int frames;
+  int result = settle_tags(conn, chan, tags, count, multiple_, SETTLE_NACK,
+                           requeue_, &frames);
   if (result != AMQP_STATUS_OK) {
     char errbuff[200];
     render_amqp_library_error(result, conn, &conn->chan, errbuff, 200);
+    conn_unlock(conn);
     Rf_error("Failed to nack message(s). %s", errbuff);
   }
 
-  return R_NilValue;
+  conn_unlock(conn);
+  return ScalarInteger(frames);
+}
+
+SEXP R_amqp_reject_on_channel(SEXP ptr, SEXP chan_ptr, SEXP delivery_tag,
+                              SEXP requeue)
+{
+  R_xlen_t count;
+  uint64_t *tags = parse_delivery_tags(delivery_tag, &count);
+  int requeue_ = asLogical(requeue) == 1;
+
+  connection *conn = (connection *) R_ExternalPtrAddr(ptr);
+  conn_lock(conn);
+  /* Without a channel, settle messages from amqp_get(). */
+  channel *chan = NULL;
+  if (Rf_isNull(chan_ptr)) {
+    chan = conn ? &conn->chan : NULL;
+  } else {
+    chan = (channel *) R_ExternalPtrAddr(chan_ptr);
+  }
+  if (!conn || !chan) {
+    conn_unlock(conn);
+    Rf_error("Failed to reject message(s). Invalid connection or channel object.");
+  }
+  if (!conn->is_connected) {
+    chan->is_open = 0;
+    conn_unlock(conn);
+    Rf_error("Failed to reject message(s). Not connected to a server.");
+  }
+  if (!chan->is_open) {
+    conn_unlock(conn);
+    Rf_error("Failed to reject message(s). Channel is closed.");
+  }
+
+  int frames;
+  int result = settle_tags(conn, chan, tags, count, 0, SETTLE_REJECT,
+                           requeue_, &frames);
+  if (result != AMQP_STATUS_OK) {
+    char errbuff[200];
+    render_amqp_library_error(result, conn, &conn->chan, errbuff, 200);
+    conn_unlock(conn);
+    Rf_error("Failed to reject message(s). %s", errbuff);
+  }
+
+  conn_unlock(conn);
+  return ScalarInteger(frames);
 }
@@ -10,8 +10,11 @@ SEXP R_amqp_bind_queue(SEXP ptr, SEXP queue, SEXP exchange, SEXP routing_key,
                        SEXP args)
 {
   connection *conn = (connection *) R_ExternalPtrAddr(ptr);
+  conn_lock(conn);
   char errbuff[200];
   if (ensure_valid_channel(conn, &conn->chan, errbuff, 200) < 0) {
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to find an open channel. %s", errbuff);
     return R_NilValue;
   }
@@ -27,9 +30,16 @@ SEXP R_amqp_bind_queue(SEXP ptr, SEXP queue, SEXP exchange, SEXP routing_key,
   if (bind_ok == NULL) {
     amqp_rpc_reply_t reply = amqp_get_rpc_reply(conn->conn);
     render_amqp_error(reply, conn, &conn->chan, errbuff, 200);
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to bind queue. %s", errbuff);
   }
 
+  record_topology(conn, TOPOLOGY_QUEUE_BINDING, queue_str, exchange_str,
+                  routing_key_str, 0, arg_table);
+
+  conn_unlock(conn);
+  raise_warnings(conn);
   return R_NilValue;
 }
 
@@ -37,8 +47,11 @@ SEXP R_amqp_unbind_queue(SEXP ptr, SEXP queue, SEXP exchange, SEXP routing_key,
                          SEXP args)
 {
   connection *conn = (connection *) R_ExternalPtrAddr(ptr);
+  conn_lock(conn);
   char errbuff[200];
   if (ensure_valid_channel(conn, &conn->chan, errbuff, 200) < 0) {
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to find an open channel. %s", errbuff);
     return R_NilValue;
   }
@@ -54,9 +67,16 @@ SEXP R_amqp_unbind_queue(SEXP ptr, SEXP queue, SEXP exchange, SEXP routing_key,
   if (unbind_ok == NULL) {
     amqp_rpc_reply_t reply = amqp_get_rpc_reply(conn->conn);
     render_amqp_error(reply, conn, &conn->chan, errbuff, 200);
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to unbind queue. %s", errbuff);
   }
 
+  forget_topology(conn, TOPOLOGY_QUEUE_BINDING, queue_str, exchange_str,
+                  routing_key_str);
+
+  conn_unlock(conn);
+  raise_warnings(conn);
   return R_NilValue;
 }
 
@@ -64,8 +84,11 @@ SEXP R_amqp_bind_exchange(SEXP ptr, SEXP dest, SEXP source, SEXP routing_key,
                           SEXP args)
 {
   connection *conn = (connection *) R_ExternalPtrAddr(ptr);
+  conn_lock(conn);
   char errbuff[200];
   if (ensure_valid_channel(conn, &conn->chan, errbuff, 200) < 0) {
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to find an open channel. %s", errbuff);
     return R_NilValue;
   }
@@ -81,9 +104,16 @@ SEXP R_amqp_bind_exchange(SEXP ptr, SEXP dest, SEXP source, SEXP routing_key,
   if (bind_ok == NULL) {
     amqp_rpc_reply_t reply = amqp_get_rpc_reply(conn->conn);
     render_amqp_error(reply, conn, &conn->chan, errbuff, 200);
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to bind exchange. %s", errbuff);
   }
 
+  record_topology(conn, TOPOLOGY_EXCHANGE_BINDING, dest_str, source_str,
+                  routing_key_str, 0, arg_table);
+
+  conn_unlock(conn);
+  raise_warnings(conn);
   return R_NilValue;
 }
 
@@ -91,8 +121,11 @@ SEXP R_amqp_unbind_exchange(SEXP ptr, SEXP dest, SEXP source, SEXP routing_key,
                          SEXP args)
 {
   connection *conn = (connection *) R_ExternalPtrAddr(ptr);
+  conn_lock(conn);
   char errbuff[200];
   if (ensure_valid_channel(conn, &conn->chan, errbuff, 200) < 0) {
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to find an open channel. %s", errbuff);
     return R_NilValue;
   }
@@ -108,8 +141,15 @@ SEXP R_amqp_unbind_exchange(SEXP ptr, SEXP dest, SEXP source, SEXP routing_key,
   if (unbind_ok == NULL) {
     amqp_rpc_reply_t reply = amqp_get_rpc_reply(conn->conn);
     render_amqp_error(reply, conn, &conn->chan, errbuff, 200);
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to unbind exchange. %s", errbuff);
   }
 
+  forget_topology(conn, TOPOLOGY_EXCHANGE_BINDING, dest_str, source_str,
+                  routing_key_str);
+
+  conn_unlock(conn);
+  raise_warnings(conn);
   return R_NilValue;
 }
@@ -0,0 +1,281 @@
+#include <stdlib.h> /* for malloc, free */
+#include <string.h> /* for memcpy */
+#include <sys/time.h> /* for gettimeofday */
+
+#include <amqp.h>
+#include <amqp_framing.h>
+
+#include "longears.h"
+#include "connection.h"
+#include "utils.h"
+
+/* RabbitMQ can block publishing connections when it runs low on memory or
+   disk space, and (because we advertise the connection.blocked capability) it
+   tells us when it does so. Publishing to a blocked connection would wedge the
+   socket once its buffers fill up, so instead we keep messages locally until
+   the connection is unblocked. */
+
+/* An upper limit on the size of message bodies held while blocked. */
+#define MAX_PENDING_BYTES (64 * 1024 * 1024)
+
+static double now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int handle_blocked_frame(connection *conn, const amqp_frame_t *frame)
+{
+  if (frame->frame_type != AMQP_FRAME_METHOD || frame->channel != 0) {
+    return 0;
+  }
+
+  switch (frame->payload.method.id) {
+  case AMQP_CONNECTION_BLOCKED_METHOD: {
+    amqp_connection_blocked_t *method;
+    method = (amqp_connection_blocked_t *) frame->payload.method.decoded;
+    if (!conn->blocked) {
+      conn->blocked = 1;
+      conn->blocked_since = now();
+      conn->blocked_count++;
+    }
+    snprintf(conn->blocked_reason, sizeof(conn->blocked_reason), "%.*s",
+             (int) method->reason.len, (const char *) method->reason.bytes);
+    return 1;
+  }
+  case AMQP_CONNECTION_UNBLOCKED_METHOD:
+    if (conn->blocked) {
+      conn->blocked_seconds += now() - conn->blocked_since;
+      conn->blocked = 0;
+    }
+    conn->blocked_reason[0] = '\0';
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+void reset_blocked_state(connection *conn)
+{
+  if (conn->blocked) {
+    conn->blocked_seconds += now() - conn->blocked_since;
+  }
+  conn->blocked = 0;
+  conn->blocked_reason[0] = '\0';
+}
+
+double total_blocked_seconds(const connection *conn)
+{
+  double total = conn->blocked_seconds;
+  if (conn->blocked) {
+    total += now() - conn->blocked_since;
+  }
+  return total;
+}
+
+int poll_blocked_state(connection *conn, char *buffer, size_t len)
+{
+  /* Consumers read from the socket themselves (and handle these frames when
+     they do), so we can only read without losing messages when there are
+     none. This includes consumers started through the C API. */
+  if (!conn->is_connected || conn->consumers || conn->api_consumers ||
+      conn->listening) {
+    return 0;
+  }
+
+  amqp_frame_t frame;
+  struct timeval tv;
+  tv.tv_sec = 0;
+  tv.tv_usec = 0;
+  for (;;) {
+    int status = amqp_simple_wait_frame_noblock(conn->conn, &frame, &tv);
+    if (status == AMQP_STATUS_TIMEOUT) {
+      return 0;
+    } else if (status != AMQP_STATUS_OK) {
+      render_amqp_library_error(status, conn, &conn->chan, buffer, len);
+      return -1;
+    }
+    if (handle_blocked_frame(conn, &frame) ||
+        frame.frame_type != AMQP_FRAME_METHOD) {
+      /* Content frames (e.g. from basic.return) are discarded. */
+      continue;
+    }
+
+    switch (frame.payload.method.id) {
+    case AMQP_CHANNEL_CLOSE_METHOD: {
+      /* An earlier publish failed, e.g. because the exchange does not exist.
+         Surface the error now, as we would on the next synchronous method. */
+      amqp_channel_close_t *method;
+      method = (amqp_channel_close_t *) frame.payload.method.decoded;
+      snprintf(buffer, len, "%.*s", (int) method->reply_text.len,
+               (const char *) method->reply_text.bytes);
+      amqp_channel_close_ok_t close_ok;
+      amqp_send_method(conn->conn, frame.channel, AMQP_CHANNEL_CLOSE_OK_METHOD,
+                       &close_ok);
+      if (frame.channel == conn->chan.chan) {
+        release_channel(conn, &conn->chan);
+      }
+      return -1;
+    }
+    case AMQP_CONNECTION_CLOSE_METHOD: {
+      amqp_connection_close_t *method;
+      method = (amqp_connection_close_t *) frame.payload.method.decoded;
+      snprintf(buffer, len, "%.*s", (int) method->reply_text.len,
+               (const char *) method->reply_text.bytes);
+      conn->is_connected = 0;
+      return -1;
+    }
+    default:
+      /* Anything else (e.g. basic.return) is ignored, as before. */
+      break;
+    }
+  }
+}
+
+int buffer_publish(connection *conn, SEXP body, amqp_bytes_t exchange,
+                   amqp_bytes_t routing_key, int mandatory, int immediate,
+                   SEXP props, char *buffer, size_t len)
+{
+  size_t body_len = XLENGTH(body);
+  if (conn->pending_bytes + body_len > MAX_PENDING_BYTES) {
+    snprintf(buffer, len,
+             "The connection is blocked (%s) and too many messages are "
+             "waiting to be published.", conn->blocked_reason);
+    return -1;
+  }
+
+  pending_publish *elt = malloc(sizeof(pending_publish));
+  elt->exchange = amqp_bytes_malloc_dup(exchange);
+  elt->routing_key = amqp_bytes_malloc_dup(routing_key);
+  elt->mandatory = mandatory;
+  elt->immediate = immediate;
+  /* Hold on to the R objects rather than copying them. */
+  elt->body = body;
+  elt->props = props;
+  R_PreserveObject(body);
+  R_PreserveObject(props);
+  elt->next = NULL;
+
+  if (conn->pending_tail) {
+    conn->pending_tail->next = elt;
+  } else {
+    conn->pending_head = elt;
+  }
+  conn->pending_tail = elt;
+  conn->pending_count++;
+  conn->pending_bytes += body_len;
+  return 0;
+}
+
+static void free_pending(connection *conn, pending_publish *elt)
+{
+  conn->pending_head = elt->next;
+  if (!conn->pending_head) {
+    conn->pending_tail = NULL;
+  }
+  conn->pending_count--;
+  conn->pending_bytes -= XLENGTH(elt->body);
+  amqp_bytes_free(elt->exchange);
+  amqp_bytes_free(elt->routing_key);
+  R_ReleaseObject(elt->body);
+  R_ReleaseObject(elt->props);
+  free(elt);
+}
+
+int flush_publishes(connection *conn, char *buffer, size_t len)
+{
+  if (!conn->pending_head || conn->blocked) return 0;
+  if (ensure_valid_channel(conn, &conn->chan, buffer, len) < 0) return -1;
+
+  while (conn->pending_head && !conn->blocked) {
+    pending_publish *elt = conn->pending_head;
+    amqp_bytes_t body;
+    body.len = XLENGTH(elt->body);
+    body.bytes = (void *) RAW(elt->body);
+    amqp_basic_properties_t *props = NULL;
+    if (TYPEOF(elt->props) != NILSXP) {
+      props = R_ExternalPtrAddr(elt->props);
+    }
+
+    int result = amqp_basic_publish(conn->conn, conn->chan.chan, elt->exchange,
+                                    elt->routing_key, elt->mandatory,
+                                    elt->immediate, props, body);
+    if (result != AMQP_STATUS_OK) {
+      /* Keep the message, so that it can be retried. */
+      render_amqp_library_error(result, conn, &conn->chan, buffer, len);
+      return -1;
+    }
+    free_pending(conn, elt);
+  }
+  return 0;
+}
+
+void clear_publishes(connection *conn)
+{
+  while (conn->pending_head) {
+    free_pending(conn, conn->pending_head);
+  }
+}
+
+SEXP R_amqp_is_blocked(SEXP ptr)
+{
+  connection *conn = (connection *) R_ExternalPtrAddr(ptr);
+  if (!conn) {
+    Rf_error("The amqp connection no longer exists.");
+    return R_NilValue;
+  }
+
+  char errbuff[200];
+  conn_lock(conn);
+  int res = poll_blocked_state(conn, errbuff, 200);
+  if (res == 0 && conn->is_connected) {
+    res = flush_publishes(conn, errbuff, 200);
+  }
+  int blocked = conn->blocked;
+  conn_unlock(conn);
+  if (res < 0) {
+    Rf_error("Failed to check connection state. %s", errbuff);
+  }
+  return ScalarLogical(blocked);
+}
+
+SEXP R_amqp_blocked_stats(SEXP ptr)
+{
+  connection *conn = (connection *) R_ExternalPtrAddr(ptr);
+  if (!conn) {
+    Rf_error("The amqp connection no longer exists.");
+    return R_NilValue;
+  }
+
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, 6));
+  SEXP names = PROTECT(Rf_allocVector(STRSXP, 6));
+  SET_STRING_ELT(names, 0, Rf_mkChar("blocked"));
+  SET_STRING_ELT(names, 1, Rf_mkChar("reason"));
+  SET_STRING_ELT(names, 2, Rf_mkChar("times_blocked"));
+  SET_STRING_ELT(names, 3, Rf_mkChar("seconds_blocked"));
+  SET_STRING_ELT(names, 4, Rf_mkChar("messages_buffered"));
+  SET_STRING_ELT(names, 5, Rf_mkChar("bytes_buffered"));
+  Rf_setAttrib(out, R_NamesSymbol, names);
+
+  conn_lock(conn);
+  int blocked = conn->blocked;
+  char reason[sizeof(conn->blocked_reason)];
+  memcpy(reason, conn->blocked_reason, sizeof(reason));
+  int count = conn->blocked_count;
+  double seconds = total_blocked_seconds(conn);
+  int pending = conn->pending_count;
+  double pending_bytes = (double) conn->pending_bytes;
+  conn_unlock(conn);
+
+  SET_VECTOR_ELT(out, 0, ScalarLogical(blocked));
+  SET_VECTOR_ELT(out, 1, blocked ? Rf_mkString(reason)
+                                 : ScalarString(NA_STRING));
+  SET_VECTOR_ELT(out, 2, ScalarInteger(count));
+  SET_VECTOR_ELT(out, 3, ScalarReal(seconds));
+  SET_VECTOR_ELT(out, 4, ScalarInteger(pending));
+  SET_VECTOR_ELT(out, 5, ScalarReal(pending_bytes));
+
+  UNPROTECT(2);
+  return out;
+}
@@ -0,0 +1,121 @@
+#include <cstdlib> /* for malloc, free */
+#include <pthread.h>
+
+#include <later_api.h>
+
+#include "longears.h"
+#include "connection.h"
+
+/* This implements connecting (and reconnecting) without blocking the main
+   thread. The socket, login handshake, and initial channel are handled on a
+   background thread, which then hands back to the event loop so that the rest
+   of the work -- including anything that touches R -- can happen on the main
+   thread.
+
+   The connection's mutex is held while connecting, so other operations on the
+   same connection will wait for the attempt to finish. */
+
+typedef struct connect_task {
+  connection *conn;
+  SEXP done;
+  int loop_id;
+  /* Whether the socket was opened by this attempt. */
+  int opened;
+  int result;
+  char errbuff[200];
+} connect_task;
+
+static void connect_done(void *data)
+{
+  connect_task *task = (connect_task *) data;
+  connection *conn = task->conn;
+  conn->connecting = 0;
+
+  /* Finish whenever the socket was opened, even if the channel could not be,
+     so that topology is replayed and lost consumers are cleaned up. */
+  if (task->opened) {
+    conn_lock(conn);
+    lconnect_finish(conn);
+    conn_unlock(conn);
+    raise_warnings(conn);
+  }
+  SEXP msg = R_NilValue;
+  if (task->result < 0) {
+    msg = Rf_mkString(task->errbuff);
+  }
+  PROTECT(msg);
+  SEXP call = PROTECT(Rf_lang2(task->done, msg));
+  R_ReleaseObject(task->done);
+  free(task);
+
+  Rf_eval(call, R_GlobalEnv);
+  UNPROTECT(2);
+}
+
+static void * connect_run(void *data)
+{
+  connect_task *task = (connect_task *) data;
+  connection *conn = task->conn;
+
+  conn_lock(conn);
+  /* Prevent ensure_valid_channel() from trying to recover the connection
+     itself, since that can involve R. */
+  int recovering = conn->recovering;
+  conn->recovering = 1;
+  task->result = lconnect_open(conn, task->errbuff, 200);
+  if (task->result < 0) {
+    task->opened = 0;
+  } else {
+    task->result = ensure_valid_channel(conn, &conn->chan, task->errbuff, 200);
+  }
+  conn->recovering = recovering;
+  conn_unlock(conn);
+
+  later::later(connect_done, data, 0, task->loop_id);
+  return NULL;
+}
+
+extern "C" SEXP R_amqp_connect_later(SEXP ptr, SEXP done, SEXP loop)
+{
+  connection *conn = (connection *) R_ExternalPtrAddr(ptr);
+  if (!conn) {
+    Rf_error("The amqp connection no longer exists.");
+  }
+  if (conn->connecting) {
+    Rf_error("A connection attempt is already in progress.");
+  }
+
+  connect_task *task = (connect_task *) malloc(sizeof(connect_task));
+  task->conn = conn;
+  task->done = done;
+  task->loop_id = Rf_asInteger(Rf_findVarInFrame(loop, Rf_install("id")));
+  task->opened = !conn->is_connected;
+  task->result = 0;
+  task->errbuff[0] = '\0';
+
+  /* The callback refers to the connection object, which keeps it alive until
+     the attempt is resolved. */
+  R_PreserveObject(done);
+
+  if (!task->opened) {
+    /* Already connected, so just resolve on the event loop. */
+    later::later(connect_done, (void *) task, 0, task->loop_id);
+    return R_NilValue;
+  }
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  conn->connecting = 1;
+  int res = pthread_create(&thread, &attr, connect_run, (void *) task);
+  pthread_attr_destroy(&attr);
+  if (res != 0) {
+    conn->connecting = 0;
+    R_ReleaseObject(done);
+    free(task);
+    Rf_error("Failed to create connection thread. Error: %d.", res);
+  }
+
+  return R_NilValue;
+}
@@ -2,9 +2,20 @@
 #include <string.h>
 #include <sys/time.h>
 
+#ifdef _WIN32
+#include <winsock2.h> /* for setsockopt */
+#else
+#include <sys/socket.h> /* for setsockopt */
+#include <netinet/in.h> /* for IPPROTO_TCP */
+#include <netinet/tcp.h> /* for TCP_NODELAY */
+#endif
+
 #include <amqp.h>
 #include <amqp_tcp_socket.h>
 #include <amqp_framing.h>
+#ifdef HAVE_AMQP_SSL
+#include <amqp_ssl_socket.h>
+#endif
 
 #include "longears.h"
 #include "connection.h"
@@ -17,48 +28,179 @@ static void R_finalize_amqp_connection(SEXP ptr)
 {
   connection *conn = (connection *) R_ExternalPtrAddr(ptr);
   if (conn) {
+    stop_heartbeat(conn);
     // Attempt to close the connection, if it appears to be open.
     if (conn->conn) {
       amqp_connection_close(conn->conn, AMQP_REPLY_SUCCESS);
       amqp_destroy_connection(conn->conn);
     }
-    if (conn->bg_conn) {
-      destroy_bg_conn(conn->bg_conn);
+    if (conn->bg_conns) {
+      for (int i = 0; i < conn->bg_threads; i++) {
+        destroy_bg_conn(conn->bg_conns[i]);
+      }
+      free(conn->bg_conns);
     }
+    destroy_topology(conn);
+    clear_publishes(conn);
+    clear_warnings(conn);
+    free(conn->channels);
+    free(conn->hosts);
+    free(conn->ports);
+    pthread_mutex_destroy(&conn->mutex);
     free(conn);
     conn = NULL;
   }
   R_ClearExternalPtr(ptr);
 }
 
+static const char * optional_path(SEXP x)
+{
+  if (Rf_isNull(x) || Rf_length(x) < 1) return NULL;
+  return CHAR(STRING_ELT(x, 0));
+}
+
+static int decode_tls_options(SEXP tls, tls_options *opts)
+{
+  memset(opts, 0, sizeof(tls_options));
+  opts->enabled = !Rf_isNull(tls);
+  if (!opts->enabled) return 0;
+#ifndef HAVE_AMQP_SSL
+  return -1;
+#else
+  /* Elements are in the order used by amqp_tls(). */
+  opts->cacert = optional_path(VECTOR_ELT(tls, 0));
+  opts->cert = optional_path(VECTOR_ELT(tls, 1));
+  opts->key = optional_path(VECTOR_ELT(tls, 2));
+  opts->verify_peer = asLogical(VECTOR_ELT(tls, 3)) == 1;
+  opts->verify_hostname = asLogical(VECTOR_ELT(tls, 4)) == 1;
+  return 0;
+#endif
+}
+
 SEXP R_amqp_connect(SEXP host, SEXP port, SEXP vhost, SEXP username,
-                    SEXP password, SEXP timeout, SEXP name)
+                    SEXP password, SEXP timeout, SEXP name, SEXP bg_threads,
+                    SEXP heartbeat_thread, SEXP recover, SEXP recover_attempts,
+                    SEXP recover_backoff, SEXP channel_max, SEXP frame_max,
+                    SEXP heartbeat, SEXP tcp_nodelay, SEXP sndbuf,
+                    SEXP rcvbuf, SEXP tls, SEXP lazy)
 {
-  const char *host_str = CHAR(asChar(host));
-  int port_num = asInteger(port);
+  int host_count = Rf_length(host);
+  if (TYPEOF(host) != STRSXP || host_count < 1 ||
+      Rf_length(port) != host_count) {
+    Rf_error("Each host must have a corresponding port.");
+    return R_NilValue;
+  }
+  SEXP ports = PROTECT(Rf_coerceVector(port, INTSXP));
   const char *vhost_str = CHAR(asChar(vhost));
   const char *username_str = CHAR(asChar(username));
   const char *password_str = CHAR(asChar(password));
   int seconds = asInteger(timeout);
   const char *name_str = CHAR(asChar(name));
+  int threads = asInteger(bg_threads);
+  if (threads == NA_INTEGER || threads < 1) {
+    Rf_error("The number of background threads must be a positive integer.");
+    return R_NilValue;
+  }
+  int use_heartbeat = asLogical(heartbeat_thread);
+  int attempts = asInteger(recover_attempts);
+  double backoff = asReal(recover_backoff);
+  if (attempts == NA_INTEGER || attempts < 1) {
+    Rf_error("The number of recovery attempts must be a positive integer.");
+    return R_NilValue;
+  }
+  if (ISNAN(backoff) || backoff < 0) {
+    Rf_error("The recovery backoff must be a non-negative number of seconds.");
+    return R_NilValue;
+  }
+  int channels = asInteger(channel_max);
+  if (channels == NA_INTEGER || channels < 0 || channels > 65535) {
+    Rf_error("The maximum number of channels must be between 0 and 65535.");
+    return R_NilValue;
+  }
+  int frame_size = asInteger(frame_max);
+  if (frame_size == NA_INTEGER || frame_size < AMQP_FRAME_MIN_SIZE) {
+    Rf_error("The maximum frame size must be at least %d bytes.",
+             AMQP_FRAME_MIN_SIZE);
+    return R_NilValue;
+  }
+  int heartbeat_secs = asInteger(heartbeat);
+  if (heartbeat_secs == NA_INTEGER || heartbeat_secs < 0 ||
+      heartbeat_secs > 65535) {
+    Rf_error("The heartbeat must be a non-negative number of seconds.");
+    return R_NilValue;
+  }
+  int sndbuf_size = asInteger(sndbuf);
+  int rcvbuf_size = asInteger(rcvbuf);
+  if (sndbuf_size == NA_INTEGER || sndbuf_size < 0 ||
+      rcvbuf_size == NA_INTEGER || rcvbuf_size < 0) {
+    Rf_error("Socket buffer sizes must be non-negative integers.");
+    return R_NilValue;
+  }
+  tls_options tls_opts;
+  if (decode_tls_options(tls, &tls_opts) < 0) {
+    Rf_error("This build of longears does not support TLS connections.");
+    return R_NilValue;
+  }
 
   connection *conn = malloc(sizeof(connection)); // NOTE: Assuming this works.
-  conn->host = host_str;
-  conn->port = port_num;
+  conn->hosts = malloc(host_count * sizeof(const char *));
+  conn->ports = malloc(host_count * sizeof(int));
+  for (int i = 0; i < host_count; i++) {
+    conn->hosts[i] = CHAR(STRING_ELT(host, i));
+    conn->ports[i] = INTEGER(ports)[i];
+  }
+  conn->host_count = host_count;
+  conn->host_index = -1;
+  UNPROTECT(1);
   conn->vhost = vhost_str;
   conn->username = username_str;
   conn->password = password_str;
   conn->name = name_str;
   conn->timeout = seconds;
+  conn->requested_channels = channels;
+  conn->frame_max = frame_size;
+  conn->heartbeat_interval = heartbeat_secs;
+  conn->tcp_nodelay = asLogical(tcp_nodelay) == 1;
+  conn->sndbuf = sndbuf_size;
+  conn->rcvbuf = rcvbuf_size;
+  conn->tls = tls_opts;
   conn->chan.chan = 0;
   conn->chan.is_open = 0;
-  conn->next_chan = 1;
+  conn->channels = NULL;
+  conn->channel_max = 0;
   conn->consumers = NULL;
-  conn->bg_conn = NULL;
+  conn->api_consumers = 0;
+  conn->bg_conns = NULL;
+  conn->bg_threads = threads;
+  conn->listening = 0;
+  conn->loop_id = 0;
+  conn->max_per_tick = 0;
+  conn->pending_callbacks = 0;
+  conn->lock_count = 0;
+  conn->has_heartbeat = 0;
+  conn->recover = asLogical(recover) == 1;
+  conn->recover_attempts = attempts;
+  conn->recover_backoff = backoff;
+  conn->recovering = 0;
+  conn->connecting = 0;
+  conn->topology = NULL;
+  conn->blocked = 0;
+  conn->blocked_reason[0] = '\0';
+  conn->blocked_since = 0;
+  conn->blocked_seconds = 0;
+  conn->blocked_count = 0;
+  conn->pending_head = NULL;
+  conn->pending_tail = NULL;
+  conn->pending_count = 0;
+  conn->pending_bytes = 0;
+  conn->warnings = NULL;
+  conn->strings = NULL;
   conn->is_connected = 0;
   conn->conn = amqp_new_connection();
 
   if (!conn->conn) {
+    free(conn->hosts);
+    free(conn->ports);
     free(conn);
     Rf_error("Failed to create an amqp connection.");
     return R_NilValue;
@@ -69,16 +211,36 @@ SEXP R_amqp_connect(SEXP host, SEXP port, SEXP vhost, SEXP username,
    * connection error conditions the stack-allocated array above will trigger
    * errors due to uninitialized memory. */
   memset(msg, 0, 120);
-  if (lconnect(conn, msg, 120) < 0) {
+  if (asLogical(lazy) != 1 && lconnect(conn, msg, 120) < 0) {
     amqp_destroy_connection(conn->conn);
+    free(conn->channels);
+    free(conn->hosts);
+    free(conn->ports);
     free(conn);
     Rf_error("Failed to connect to server. %s", msg);
     return R_NilValue;
   }
 
-  SEXP ptr = PROTECT(R_MakeExternalPtr(conn, R_NilValue, R_NilValue));
+  init_conn_mutex(conn);
+  if (use_heartbeat == 1) {
+    int res = start_heartbeat(conn);
+    if (res != 0) {
+      amqp_connection_close(conn->conn, AMQP_REPLY_SUCCESS);
+      amqp_destroy_connection(conn->conn);
+      pthread_mutex_destroy(&conn->mutex);
+      free(conn->channels);
+      free(conn->hosts);
+      free(conn->ports);
+      free(conn);
+      Rf_error("Failed to create heartbeat thread. Error: %d.", res);
+    }
+  }
+
+  /* The string cache is kept alive by the external pointer. */
+  conn->strings = PROTECT(Rf_allocVector(VECSXP, STRING_CACHE_SIZE));
+  SEXP ptr = PROTECT(R_MakeExternalPtr(conn, R_NilValue, conn->strings));
   R_RegisterCFinalizerEx(ptr, R_finalize_amqp_connection, 1);
-  UNPROTECT(1);
+  UNPROTECT(2);
   return ptr;
 }
 
@@ -92,6 +254,47 @@ SEXP R_amqp_is_connected(SEXP ptr)
   return ScalarLogical(conn->is_connected);
 }
 
+SEXP R_amqp_tune_params(SEXP ptr)
+{
+  connection *conn = (connection *) R_ExternalPtrAddr(ptr);
+  if (!conn) {
+    Rf_error("The amqp connection no longer exists.");
+    return R_NilValue;
+  }
+
+  SEXP out = PROTECT(Rf_allocVector(INTSXP, 3));
+  SEXP names = PROTECT(Rf_allocVector(STRSXP, 3));
+  SET_STRING_ELT(names, 0, Rf_mkChar("channel_max"));
+  SET_STRING_ELT(names, 1, Rf_mkChar("frame_max"));
+  SET_STRING_ELT(names, 2, Rf_mkChar("heartbeat"));
+  Rf_setAttrib(out, R_NamesSymbol, names);
+
+  conn_lock(conn);
+  if (conn->is_connected && conn->conn) {
+    INTEGER(out)[0] = amqp_get_channel_max(conn->conn);
+    INTEGER(out)[1] = amqp_get_frame_max(conn->conn);
+    INTEGER(out)[2] = amqp_get_heartbeat(conn->conn);
+  } else {
+    INTEGER(out)[0] = NA_INTEGER;
+    INTEGER(out)[1] = NA_INTEGER;
+    INTEGER(out)[2] = NA_INTEGER;
+  }
+  conn_unlock(conn);
+
+  UNPROTECT(2);
+  return out;
+}
+
+SEXP R_amqp_current_endpoint(SEXP ptr)
+{
+  connection *conn = (connection *) R_ExternalPtrAddr(ptr);
+  if (!conn) {
+    Rf_error("The amqp connection no longer exists.");
+    return R_NilValue;
+  }
+  return ScalarInteger(conn->host_index + 1);
+}
+
 SEXP R_amqp_client_properties(SEXP ptr)
 {
   connection *conn = (connection *) R_ExternalPtrAddr(ptr);
@@ -100,8 +303,11 @@ SEXP R_amqp_client_properties(SEXP ptr)
     return R_NilValue;
   }
 
+  conn_lock(conn);
   amqp_table_t *props = amqp_get_client_properties(conn->conn);
-  return decode_table(props);
+  SEXP out = decode_table(props, NULL);
+  conn_unlock(conn);
+  return out;
 }
 
 SEXP R_amqp_server_properties(SEXP ptr)
@@ -112,8 +318,11 @@ SEXP R_amqp_server_properties(SEXP ptr)
     return R_NilValue;
   }
 
+  conn_lock(conn);
   amqp_table_t *props = amqp_get_server_properties(conn->conn);
-  return decode_table(props);
+  SEXP out = decode_table(props, NULL);
+  conn_unlock(conn);
+  return out;
 }
 
 SEXP R_amqp_reconnect(SEXP ptr)
@@ -128,7 +337,11 @@ SEXP R_amqp_reconnect(SEXP ptr)
     Rprintf("Connection is already open.\n");
   } else {
     char msg[120];
-    if (lconnect(conn, msg, 120) < 0) {
+    conn_lock(conn);
+    int res = lconnect(conn, msg, 120);
+    conn_unlock(conn);
+    raise_warnings(conn);
+    if (res < 0) {
       Rf_error("Failed to reconnect to server. %s", msg);
       return R_NilValue;
     }
@@ -149,10 +362,12 @@ SEXP R_amqp_disconnect(SEXP ptr)
     return R_NilValue;
   }
 
+  conn_lock(conn);
   amqp_rpc_reply_t reply = amqp_connection_close(conn->conn, AMQP_REPLY_SUCCESS);
   if (reply.reply_type != AMQP_RESPONSE_NORMAL) {
     char msg[120];
     render_amqp_error(reply, conn, &conn->chan, msg, 120);
+    conn_unlock(conn);
     Rf_error("Failed to disconnect. %s", msg);
     return R_NilValue;
   }
@@ -161,6 +376,7 @@ SEXP R_amqp_disconnect(SEXP ptr)
   conn->is_connected = 0;
   amqp_destroy_connection(conn->conn);
   conn->conn = NULL;
+  conn_unlock(conn);
 
   mark_consumers_closed(conn);
 
@@ -170,11 +386,97 @@ SEXP R_amqp_disconnect(SEXP ptr)
   return R_NilValue;
 }
 
-int lconnect(connection *conn, char *buffer, size_t len)
+void init_conn_mutex(connection *conn)
 {
-  // Assume conn->conn is valid.
-  if (conn->is_connected) return 0;
+  /* The mutex is recursive because R code (e.g. consumer callbacks or
+     finalizers) can re-enter the package while it is held. */
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&conn->mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+void conn_lock(connection *conn)
+{
+  if (!conn) return;
+  pthread_mutex_lock(&conn->mutex);
+  /* Lets the heartbeat thread see that the connection is in use. */
+  conn->lock_count++;
+}
+
+void conn_unlock(connection *conn)
+{
+  if (conn) pthread_mutex_unlock(&conn->mutex);
+}
+
+static int set_socket_options(const connection *conn, int sockfd,
+                              char *buffer, size_t len)
+{
+  /* Buffer sizes are ideally set before connecting, but librabbitmq opens the
+     socket for us. Linux and Windows still honour them afterwards, although
+     the TCP window scale has already been negotiated by then. */
+  int flag = 1;
+  if (conn->tcp_nodelay &&
+      setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (const char *) &flag,
+                 sizeof(flag)) != 0) {
+    snprintf(buffer, len, "Failed to set TCP_NODELAY on the socket.");
+    return -1;
+  }
+  if (conn->sndbuf > 0 &&
+      setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, (const char *) &conn->sndbuf,
+                 sizeof(conn->sndbuf)) != 0) {
+    snprintf(buffer, len, "Failed to set the socket send buffer size.");
+    return -1;
+  }
+  if (conn->rcvbuf > 0 &&
+      setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, (const char *) &conn->rcvbuf,
+                 sizeof(conn->rcvbuf)) != 0) {
+    snprintf(buffer, len, "Failed to set the socket receive buffer size.");
+    return -1;
+  }
+  return 0;
+}
 
+static amqp_socket_t * new_tls_socket(connection *conn, char *buffer,
+                                      size_t len)
+{
+#ifdef HAVE_AMQP_SSL
+  amqp_socket_t *socket = amqp_ssl_socket_new(conn->conn);
+  if (!socket) {
+    snprintf(buffer, len, "Failed to create a TLS socket.");
+    return NULL;
+  }
+
+  int status;
+  if (conn->tls.cacert) {
+    status = amqp_ssl_socket_set_cacert(socket, conn->tls.cacert);
+    if (status != AMQP_STATUS_OK) {
+      snprintf(buffer, len, "Failed to load CA certificate '%s'. %s",
+               conn->tls.cacert, amqp_error_string2(status));
+      return NULL;
+    }
+  }
+  if (conn->tls.cert && conn->tls.key) {
+    status = amqp_ssl_socket_set_key(socket, conn->tls.cert, conn->tls.key);
+    if (status != AMQP_STATUS_OK) {
+      snprintf(buffer, len, "Failed to load client certificate '%s'. %s",
+               conn->tls.cert, amqp_error_string2(status));
+      return NULL;
+    }
+  }
+  amqp_ssl_socket_set_verify_peer(socket, conn->tls.verify_peer);
+  amqp_ssl_socket_set_verify_hostname(socket, conn->tls.verify_hostname);
+  return socket;
+#else
+  snprintf(buffer, len, "TLS connections are not supported.");
+  return NULL;
+#endif
+}
+
+static int open_endpoint(connection *conn, int index, char *buffer,
+                         size_t len)
+{
   if (conn->conn) {
     amqp_destroy_connection(conn->conn);
   }
@@ -184,10 +486,15 @@ int lconnect(connection *conn, char *buffer, size_t len)
   conn->chan.is_open = 0;
 
   amqp_rpc_reply_t reply;
-  amqp_socket_t *socket = amqp_tcp_socket_new(conn->conn);
+  amqp_socket_t *socket;
+  if (conn->tls.enabled) {
+    socket = new_tls_socket(conn, buffer, len);
+  } else {
+    socket = amqp_tcp_socket_new(conn->conn);
+    if (!socket) snprintf(buffer, len, "Failed to create an amqp socket.");
+  }
 
   if (!socket) {
-    snprintf(buffer, len, "Failed to create an amqp socket.");
     amqp_destroy_connection(conn->conn);
     conn->conn = NULL;
     return -1;
@@ -196,7 +503,8 @@ int lconnect(connection *conn, char *buffer, size_t len)
   struct timeval tv;
   tv.tv_sec = conn->timeout;
   tv.tv_usec = 0;
-  int sockfd = amqp_socket_open_noblock(socket, conn->host, conn->port, &tv);
+  int sockfd = amqp_socket_open_noblock(socket, conn->hosts[index],
+                                        conn->ports[index], &tv);
 
   if (sockfd < 0) {
     // This has an unhelpful error message in this case.
@@ -210,13 +518,19 @@ int lconnect(connection *conn, char *buffer, size_t len)
     return -1;
   }
 
+  if (set_socket_options(conn, sockfd, buffer, len) < 0) {
+    amqp_destroy_connection(conn->conn);
+    conn->conn = NULL;
+    return -1;
+  }
+
   amqp_table_t props, capabilities;
-  amqp_table_entry_t pentry[6], centry;
+  amqp_table_entry_t pentry[6], centry[2];
 
   props.num_entries = 6;
   props.entries = pentry;
-  capabilities.num_entries = 1;
-  capabilities.entries = &centry;
+  capabilities.num_entries = 2;
+  capabilities.entries = centry;
 
   pentry[0].key = amqp_cstring_bytes("version");
   pentry[0].value.kind = AMQP_FIELD_KIND_UTF8;
@@ -243,13 +557,19 @@ int lconnect(connection *conn, char *buffer, size_t len)
   pentry[5].value.value.table = capabilities;
 
   /* Tell the server that we can handle consumer cancel notifications. */
-  centry.key = amqp_cstring_bytes("consumer_cancel_notify");
-  centry.value.kind = AMQP_FIELD_KIND_BOOLEAN;
-  centry.value.value.boolean = 1;
+  centry[0].key = amqp_cstring_bytes("consumer_cancel_notify");
+  centry[0].value.kind = AMQP_FIELD_KIND_BOOLEAN;
+  centry[0].value.value.boolean = 1;
+
+  /* And that we want to know when the server blocks publishing. */
+  centry[1].key = amqp_cstring_bytes("connection.blocked");
+  centry[1].value.kind = AMQP_FIELD_KIND_BOOLEAN;
+  centry[1].value.value.boolean = 1;
 
   reply = amqp_login_with_properties(conn->conn, conn->vhost,
-                                     AMQP_DEFAULT_MAX_CHANNELS,
-                                     AMQP_DEFAULT_FRAME_SIZE, 60, &props,
+                                     conn->requested_channels,
+                                     conn->frame_max,
+                                     conn->heartbeat_interval, &props,
                                      AMQP_SASL_METHOD_PLAIN, conn->username,
                                      conn->password);
 
@@ -262,14 +582,67 @@ int lconnect(connection *conn, char *buffer, size_t len)
     return -1;
   }
 
+  return 0;
+}
+
+/* The parts of connecting that don't touch R, which makes them safe to run on
+   a background thread. */
+int lconnect_open(connection *conn, char *buffer, size_t len)
+{
+  if (conn->is_connected) return 0;
+
+  /* Try each endpoint in turn, starting with the one after the endpoint we
+     last connected to, so that reconnections fail over to another node. */
+  int res = -1, index = 0;
+  for (int i = 1; i <= conn->host_count && res < 0; i++) {
+    index = (conn->host_index + i) % conn->host_count;
+    res = open_endpoint(conn, index, buffer, len);
+  }
+  if (res < 0) return -1;
+
+  conn->host_index = index;
   conn->is_connected = 1;
+  reset_channels(conn);
+  reset_blocked_state(conn);
+  return 0;
+}
 
-  /* Clean up any leftover consumers. */
-  if (conn->consumers) {
-    Rf_warning("Existing consumers have been lost and must be recreated.");
+void lconnect_finish(connection *conn)
+{
+  if (conn->recover) {
+    /* Replay declarations and restart consumers. Failures here don't affect
+       the connection itself, so they are only warnings. These are deferred
+       because the caller holds the connection's mutex. */
+    char errbuff[200];
+    mark_consumers_closed(conn);
+    if (recover_topology(conn, errbuff, 200) < 0) {
+      defer_warning(conn,
+                    "Failed to recover exchanges, queues, or bindings. %s",
+                    errbuff);
+    }
+    consumer *elt = conn->consumers;
+    while (elt && conn->is_connected) {
+      if (restart_consumer(conn, &elt->chan, elt->tag, &elt->spec, errbuff,
+                           200) < 0) {
+        defer_warning(conn, "Failed to recover consumer '%.*s'. %s",
+                      (int) elt->tag.len, (const char *) elt->tag.bytes,
+                      errbuff);
+      }
+      elt = elt->next;
+    }
+  } else if (conn->consumers) {
+    /* Clean up any leftover consumers. */
+    defer_warning(conn,
+                  "Existing consumers have been lost and must be recreated.");
     mark_consumers_closed(conn);
   }
+}
 
+int lconnect(connection *conn, char *buffer, size_t len)
+{
+  if (conn->is_connected) return 0;
+  if (lconnect_open(conn, buffer, len) < 0) return -1;
+  lconnect_finish(conn);
   return 0;
 }
 
@@ -282,27 +655,93 @@ int ensure_valid_channel(connection *conn, channel *chan, char *buffer, size_t l
 
   if (!conn->is_connected) {
     chan->is_open = 0;
-    snprintf(buffer, len, "Not connected to a server.");
-    return -1;
+    /* Try to recover the connection, unless we're already doing so. */
+    if (!conn->recover || conn->recovering ||
+        reconnect_with_backoff(conn, buffer, len) < 0) {
+      snprintf(buffer, len, "Not connected to a server.");
+      return -1;
+    }
   }
   if (chan->is_open) return 0;
 
-  // The connection seems to hang indefinitely if we reuse channel IDs, so make
-  // sure to get a new one.
-  chan->chan = conn->next_chan;
-  conn->next_chan += 1;
+  chan->chan = alloc_channel(conn);
+  if (chan->chan == 0) {
+    snprintf(buffer, len, "No channels available (the maximum is %d).",
+             conn->channel_max);
+    return -1;
+  }
 
   amqp_channel_open(conn->conn, chan->chan);
   amqp_rpc_reply_t reply = amqp_get_rpc_reply(conn->conn);
   if (reply.reply_type != AMQP_RESPONSE_NORMAL) {
-    render_amqp_error(reply, conn, &conn->chan, buffer, len);
+    render_amqp_error(reply, conn, chan, buffer, len);
     return -1;
   }
 
   chan->is_open = 1;
+  /* Delivery tags start again from 1 on each channel. */
+  chan->settled = 0;
+  if (chan == &conn->chan) {
+    /* Consumers started through the C API went with the old channel. */
+    conn->api_consumers = 0;
+  }
   return 0;
 }
 
+/* Track how far the channel's deliveries have been settled without gaps, so
+   that runs of delivery tags starting there can be settled with a single
+   "multiple" frame. Settling out of order just means we stop doing so. */
+void mark_settled(channel *chan, uint64_t delivery_tag, int multiple)
+{
+  if (multiple) {
+    if (delivery_tag > chan->settled) chan->settled = delivery_tag;
+  } else if (delivery_tag == chan->settled + 1) {
+    chan->settled = delivery_tag;
+  }
+}
+
+/* Channel IDs are tracked in a bitmap so that they can be reused once their
+   channel is closed. Channel 0 is reserved for the connection itself. */
+void reset_channels(connection *conn)
+{
+  int max = amqp_get_channel_max(conn->conn);
+  if (max <= 0 || max > 65535) max = 65535;
+  free(conn->channels);
+  conn->channel_max = max;
+  conn->channels = calloc(max / 32 + 1, sizeof(uint32_t));
+  if (conn->channels) conn->channels[0] = 1;
+}
+
+amqp_channel_t alloc_channel(connection *conn)
+{
+  if (!conn->channels) return 0;
+  int words = conn->channel_max / 32 + 1;
+  for (int i = 0; i < words; i++) {
+    uint32_t word = conn->channels[i];
+    if (word == 0xFFFFFFFF) continue;
+    int bit = 0;
+    while (word & (1u << bit)) bit++;
+    int id = i * 32 + bit;
+    if (id > conn->channel_max) return 0;
+    conn->channels[i] |= 1u << bit;
+    return (amqp_channel_t) id;
+  }
+  return 0;
+}
+
+void release_channel(connection *conn, channel *chan)
+{
+  chan->is_open = 0;
+  if (chan->chan == 0 || !conn->channels || chan->chan > conn->channel_max) {
+    return;
+  }
+  conn->channels[chan->chan / 32] &= ~(1u << (chan->chan % 32));
+  if (conn->conn) {
+    amqp_maybe_release_buffers_on_channel(conn->conn, chan->chan);
+  }
+  chan->chan = 0;
+}
+
 static void mark_consumers_closed(connection *conn)
 {
   consumer *elt = conn->consumers;
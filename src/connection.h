@@ -3,8 +3,11 @@
 
 #include <Rinternals.h> /* for SEXP */
 #include <pthread.h>
+#include <sys/time.h> /* for struct timeval */
 #include <amqp.h> /* for amqp_channel_t, amqp_connection_state_t */
 
+#include "longears_api.h" /* for longears_message_handler */
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -13,32 +16,134 @@ extern "C" {
 struct consumer;
 struct bg_consumer;
 struct bg_conn;
+struct topology;
 
 typedef struct channel {
   amqp_channel_t chan;
   int is_open;
+  /* Every delivery up to and including this tag has been (n)acked. */
+  uint64_t settled;
 } channel;
 
+/* A message held back while the connection is blocked. */
+typedef struct pending_publish {
+  amqp_bytes_t exchange;
+  amqp_bytes_t routing_key;
+  SEXP body;
+  SEXP props;
+  int mandatory;
+  int immediate;
+  struct pending_publish *next;
+} pending_publish;
+
+/* A warning raised while the connection's mutex was held, which has to wait
+   until it is released (since warnings may be turned into errors). */
+typedef struct deferred_warning {
+  char msg[200];
+  struct deferred_warning *next;
+} deferred_warning;
+
+typedef struct tls_options {
+  int enabled;
+  const char *cacert;
+  const char *cert;
+  const char *key;
+  int verify_peer;
+  int verify_hostname;
+} tls_options;
+
+/* The number of slots in each connection's cache of recently decoded strings.
+   This must be a power of two. */
+#define STRING_CACHE_SIZE 128
+
 typedef struct connection {
   amqp_connection_state_t conn;
   int is_connected;
-  const char *host;
-  int port;
+  const char **hosts;
+  int *ports;
+  int host_count;
+  int host_index;
   const char *vhost;
   const char *username;
   const char *password;
   const char *name;
   int timeout;
+  int requested_channels;
+  int frame_max;
+  int heartbeat_interval;
+  int tcp_nodelay;
+  int sndbuf;
+  int rcvbuf;
+  tls_options tls;
   channel chan;
-  int next_chan;
+  uint32_t *channels;
+  int channel_max;
   struct consumer *consumers;
-  struct bg_conn *bg_conn;
+  int api_consumers;
+  struct bg_conn **bg_conns;
+  int bg_threads;
+  int listening;
+  int loop_id;
+  int max_per_tick;
+  int pending_callbacks;
+  pthread_mutex_t mutex;
+  unsigned long lock_count;
+  pthread_t heartbeat;
+  int has_heartbeat;
+  int recover;
+  int recover_attempts;
+  double recover_backoff;
+  int recovering;
+  int connecting;
+  struct topology *topology;
+  int blocked;
+  char blocked_reason[100];
+  double blocked_since;
+  double blocked_seconds;
+  int blocked_count;
+  pending_publish *pending_head;
+  pending_publish *pending_tail;
+  int pending_count;
+  size_t pending_bytes;
+  deferred_warning *warnings;
+  SEXP strings;
 } connection;
 
+/* Everything needed to restart a consumer after reconnecting. */
+typedef struct consumer_spec {
+  amqp_bytes_t queue;
+  int no_ack;
+  int exclusive;
+  int prefetch_count;
+  amqp_table_t args;
+  amqp_pool_t pool;
+} consumer_spec;
+
+/* Conditions that messages must meet to be handed to a consumer. */
+typedef struct filter_rule {
+  int routing_key;
+  amqp_bytes_t header;
+  int type;
+  int count;
+  amqp_bytes_t *strings;
+  double *numbers;
+} filter_rule;
+
+typedef struct message_filter {
+  filter_rule *rules;
+  int rule_count;
+  int ack;
+  int requeue;
+  amqp_pool_t pool;
+} message_filter;
+
 typedef struct consumer {
   connection *conn;
   channel chan;
   amqp_bytes_t tag;
+  consumer_spec spec;
+  message_filter *filter;
+  SEXP filter_ptr;
   SEXP fcall;
   SEXP rho;
   struct consumer *prev;
@@ -50,13 +155,100 @@ typedef struct bg_conn {
   pthread_t thread;
   pthread_mutex_t mutex;
   struct bg_consumer *consumers;
+  int consumer_count;
+  int running;
+  int recover;
 } bg_conn;
 
-int init_bg_conn(connection *conn);
+int init_bg_conn(connection *conn, int index);
 void destroy_bg_conn(bg_conn *conn);
+int select_bg_conn(const connection *conn);
+int bg_consumer_set_handler(SEXP consumer, longears_message_handler handler,
+                            void *data, longears_handler_finalizer finalizer);
+
+connection * api_get_connection(SEXP conn);
+int api_ensure_channel(connection *conn, amqp_connection_state_t *state,
+                       amqp_channel_t *chan, char *buffer, size_t len);
+int api_publish(connection *conn, amqp_bytes_t exchange,
+                amqp_bytes_t routing_key, amqp_bytes_t body, int mandatory,
+                int immediate, const amqp_basic_properties_t *props,
+                char *buffer, size_t len);
+int api_get(connection *conn, amqp_bytes_t queue, int no_ack,
+            amqp_envelope_t *env, char *buffer, size_t len);
+int api_ack(connection *conn, uint64_t delivery_tag, int multiple,
+            char *buffer, size_t len);
+int api_nack(connection *conn, uint64_t delivery_tag, int multiple,
+             int requeue, char *buffer, size_t len);
+int api_consume(connection *conn, amqp_bytes_t queue, amqp_bytes_t tag,
+                int no_ack, int exclusive, int prefetch_count,
+                amqp_bytes_t *tag_out, char *buffer, size_t len);
+int api_consume_message(connection *conn, struct timeval *timeout,
+                        amqp_envelope_t *env, char *buffer, size_t len);
+
+void init_conn_mutex(connection *conn);
+void conn_lock(connection *conn);
+void conn_unlock(connection *conn);
+int start_heartbeat(connection *conn);
+void stop_heartbeat(connection *conn);
+
+/* Recorded declarations and bindings, used for recovery. */
+typedef enum topology_kind {
+  TOPOLOGY_EXCHANGE,
+  TOPOLOGY_QUEUE,
+  TOPOLOGY_QUEUE_BINDING,
+  TOPOLOGY_EXCHANGE_BINDING
+} topology_kind;
+
+#define TOPOLOGY_DURABLE 1
+#define TOPOLOGY_AUTO_DELETE 2
+#define TOPOLOGY_EXCLUSIVE 4
+#define TOPOLOGY_INTERNAL 8
+
+void record_topology(connection *conn, topology_kind kind, amqp_bytes_t name,
+                     amqp_bytes_t source, amqp_bytes_t routing_key, int flags,
+                     const amqp_table_t *args);
+void forget_topology(connection *conn, topology_kind kind, amqp_bytes_t name,
+                     amqp_bytes_t source, amqp_bytes_t routing_key);
+void destroy_topology(connection *conn);
+int recover_topology(connection *conn, char *buffer, size_t len);
+void init_consumer_spec(consumer_spec *spec, amqp_bytes_t queue, int no_ack,
+                        int exclusive, int prefetch_count,
+                        const amqp_table_t *args);
+void destroy_consumer_spec(consumer_spec *spec);
+int restart_consumer(connection *conn, channel *chan, amqp_bytes_t tag,
+                     const consumer_spec *spec, char *buffer, size_t len);
+int reconnect_with_backoff(connection *conn, char *buffer, size_t len);
+double backoff_delay(const connection *conn, int attempt);
+void defer_warning(connection *conn, const char *fmt, ...);
+void raise_warnings(connection *conn);
+void clear_warnings(connection *conn);
+
+int handle_blocked_frame(connection *conn, const amqp_frame_t *frame);
+void reset_blocked_state(connection *conn);
+double total_blocked_seconds(const connection *conn);
+int poll_blocked_state(connection *conn, char *buffer, size_t len);
+int buffer_publish(connection *conn, SEXP body, amqp_bytes_t exchange,
+                   amqp_bytes_t routing_key, int mandatory, int immediate,
+                   SEXP props, char *buffer, size_t len);
+int flush_publishes(connection *conn, char *buffer, size_t len);
+void clear_publishes(connection *conn);
+
+int filter_matches(const message_filter *filter, const amqp_envelope_t *env);
+int discard_message(amqp_connection_state_t conn, amqp_channel_t chan,
+                    const message_filter *filter, uint64_t delivery_tag);
 
 int lconnect(connection *conn, char *buffer, size_t len);
+int lconnect_open(connection *conn, char *buffer, size_t len);
+void lconnect_finish(connection *conn);
+void reset_channels(connection *conn);
+amqp_channel_t alloc_channel(connection *conn);
+void release_channel(connection *conn, channel *chan);
 int ensure_valid_channel(connection *, channel *, char *, size_t);
+void mark_settled(channel *chan, uint64_t delivery_tag, int multiple);
+int handle_consume_error(connection *conn, int status, char *buffer,
+                         size_t len);
+int consume_message(connection *conn, struct timeval *tv, char *buffer,
+                    size_t len);
 
 #ifdef __cplusplus
 }
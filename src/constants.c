@@ -7,6 +7,7 @@ SEXP message_names_consume = NULL;
 SEXP message_names_get = NULL;
 SEXP properties_class = NULL;
 SEXP table_class = NULL;
+SEXP tbl_df_class = NULL;
 SEXP ptr_object_names = NULL;
 
 SEXP headers_charsxp = NULL;
@@ -71,6 +72,11 @@ void init_static_sexps()
   table_class = new_shared_vector(STRSXP, 1);
   SET_STRING_ELT(table_class, 0, Rf_mkCharLen("amqp_table", 10));
 
+  tbl_df_class = new_shared_vector(STRSXP, 3);
+  SET_STRING_ELT(tbl_df_class, 0, Rf_mkCharLen("tbl_df", 6));
+  SET_STRING_ELT(tbl_df_class, 1, Rf_mkCharLen("tbl", 3));
+  SET_STRING_ELT(tbl_df_class, 2, Rf_mkCharLen("data.frame", 10));
+
   ptr_object_names = new_shared_vector(STRSXP, 1);
   SET_STRING_ELT(ptr_object_names, 0, Rf_mkCharLen("ptr", 3));
 
@@ -13,6 +13,7 @@ extern SEXP message_names_consume;
 extern SEXP message_names_get;
 extern SEXP properties_class;
 extern SEXP table_class;
+extern SEXP tbl_df_class;
 extern SEXP ptr_object_names;
 
 extern SEXP headers_charsxp;
@@ -1,8 +1,17 @@
+#include <errno.h>
+#include <stdio.h> /* for snprintf */
 #include <stdlib.h> /* for malloc */
-#include <string.h> /* for memcpy */
+#include <string.h> /* for memcpy, strerror */
 #include <sys/time.h>
 #include <time.h> /* for time() */
 
+#ifdef _WIN32
+#include <winsock2.h> /* for WSAPoll */
+#define poll WSAPoll
+#else
+#include <poll.h>
+#endif
+
 #include <amqp.h>
 #include <amqp_tcp_socket.h>
 #include <amqp_framing.h>
@@ -16,9 +25,15 @@ static void R_finalize_consumer(SEXP ptr)
   consumer *con = (consumer *) R_ExternalPtrAddr(ptr);
   if (con) {
     /* Attempt to cancel the consumer and close the channel. */
+    conn_lock(con->conn);
     if (con->chan.is_open) {
       amqp_basic_cancel(con->conn->conn, con->chan.chan, con->tag);
-      amqp_channel_close(con->conn->conn, con->chan.chan, AMQP_REPLY_SUCCESS);
+      amqp_rpc_reply_t reply = amqp_channel_close(con->conn->conn,
+                                                  con->chan.chan,
+                                                  AMQP_REPLY_SUCCESS);
+      if (reply.reply_type == AMQP_RESPONSE_NORMAL) {
+        release_channel(con->conn, &con->chan);
+      }
     }
     /* Remove it from the global list of consumers. */
     if (con->next) {
@@ -29,9 +44,12 @@ static void R_finalize_consumer(SEXP ptr)
     } else if (con->conn->consumers == con) {
       con->conn->consumers = con->next;
     }
+    conn_unlock(con->conn);
     amqp_bytes_free(con->tag);
+    destroy_consumer_spec(&con->spec);
     R_ReleaseObject(con->fcall);
     R_ReleaseObject(con->rho);
+    R_ReleaseObject(con->filter_ptr);
     R_ClearExternalPtr(ptr);
     free(con);
     con = NULL;
@@ -40,7 +58,8 @@ static void R_finalize_consumer(SEXP ptr)
 }
 
 SEXP R_amqp_create_consumer(SEXP ptr, SEXP queue, SEXP tag, SEXP fun, SEXP rho,
-                            SEXP no_ack, SEXP exclusive, SEXP prefetch_count_, SEXP args)
+                            SEXP no_ack, SEXP exclusive, SEXP prefetch_count_, SEXP args,
+                            SEXP filter)
 {
   connection *conn = (connection *) R_ExternalPtrAddr(ptr);
   consumer *con = malloc(sizeof(consumer));
@@ -48,12 +67,18 @@ SEXP R_amqp_create_consumer(SEXP ptr, SEXP queue, SEXP tag, SEXP fun, SEXP rho,
   con->chan.chan = 0;
   con->chan.is_open = 0;
   con->tag = amqp_empty_bytes;
+  con->filter = Rf_isNull(filter) ? NULL : R_ExternalPtrAddr(filter);
+  con->filter_ptr = filter;
   con->rho = rho;
   con->prev = NULL;
   con->next = NULL;
 
   char errbuff[200];
+  conn_lock(conn);
   if (ensure_valid_channel(con->conn, &con->chan, errbuff, 200) < 0) {
+    free(con);
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to find an open channel. %s", errbuff);
     return R_NilValue;
   }
@@ -73,9 +98,15 @@ SEXP R_amqp_create_consumer(SEXP ptr, SEXP queue, SEXP tag, SEXP fun, SEXP rho,
   amqp_basic_qos_ok_t *qos_ok = amqp_basic_qos(conn->conn, con->chan.chan, 0,
                                                prefetch_count, 0);
   if (qos_ok == NULL) {
-    free(con);
     amqp_rpc_reply_t reply = amqp_get_rpc_reply(conn->conn);
-    render_amqp_error(reply, con->conn, &con->chan, errbuff, 200);
+    render_amqp_error(reply, conn, &con->chan, errbuff, 200);
+    if (con->chan.is_open) {
+      amqp_channel_close(conn->conn, con->chan.chan, AMQP_REPLY_SUCCESS);
+      release_channel(conn, &con->chan);
+    }
+    free(con);
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to set quality of service. %s", errbuff);
   }
 
@@ -84,13 +115,23 @@ SEXP R_amqp_create_consumer(SEXP ptr, SEXP queue, SEXP tag, SEXP fun, SEXP rho,
                                   0, has_no_ack, is_exclusive, *arg_table);
 
   if (consume_ok == NULL) {
-    free(con);
     amqp_rpc_reply_t reply = amqp_get_rpc_reply(conn->conn);
-    render_amqp_error(reply, con->conn, &con->chan, errbuff, 200);
+    render_amqp_error(reply, conn, &con->chan, errbuff, 200);
+    if (con->chan.is_open) {
+      amqp_channel_close(conn->conn, con->chan.chan, AMQP_REPLY_SUCCESS);
+      release_channel(conn, &con->chan);
+    }
+    free(con);
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to start a queue consumer. %s", errbuff);
   }
 
   con->tag = amqp_bytes_malloc_dup(consume_ok->consumer_tag);
+  init_consumer_spec(&con->spec, queue_str, has_no_ack, is_exclusive,
+                     prefetch_count, arg_table);
+  conn_unlock(conn);
+  raise_warnings(conn);
 
   /* Set up the callback so we don't need to construct it later. */
   con->fcall = has_no_ack ? Rf_lang2(fun, R_NilValue) :
@@ -122,21 +163,164 @@ SEXP R_amqp_create_consumer(SEXP ptr, SEXP queue, SEXP tag, SEXP fun, SEXP rho,
   }
 
   R_PreserveObject(rho);
+  R_PreserveObject(filter);
 
   UNPROTECT(1);
   return out;
 }
 
+/* Act on a library error from amqp_consume_message(). An unexpected state
+   means that some other method (e.g. connection.blocked) is waiting to be read,
+   and it must be read before anything else can be. Returns zero if consuming
+   can carry on, or -1 (with a description in buffer) if it cannot. */
+int handle_consume_error(connection *conn, int status, char *buffer,
+                         size_t len)
+{
+  /* If we get into an unexpected state, try to decode a relevant method
+     (e.g. connection.close). */
+  if (status == AMQP_STATUS_UNEXPECTED_STATE) {
+    amqp_frame_t frame;
+    status = amqp_simple_wait_frame(conn->conn, &frame);
+    /* If the server shuts down gracefully, this is how we will probably be
+       notified. */
+    if (status == AMQP_STATUS_OK && frame.frame_type == AMQP_FRAME_METHOD &&
+        frame.payload.method.id == AMQP_CONNECTION_CLOSE_METHOD) {
+      status = AMQP_STATUS_CONNECTION_CLOSED;
+    } else if (status == AMQP_STATUS_OK &&
+               frame.frame_type == AMQP_FRAME_METHOD &&
+               frame.payload.method.id == AMQP_BASIC_CANCEL_METHOD) {
+      /* If we have consumer_cancel_notify enabled, this is how we are
+         notified that e.g. deleted queues have cancelled a consumer. */
+      amqp_basic_cancel_t *cancel;
+      cancel = (amqp_basic_cancel_t *) frame.payload.method.decoded;
+      snprintf(buffer, len, "Consumer '%.*s' cancelled by the broker.",
+               (int) cancel->consumer_tag.len,
+               (const char *) cancel->consumer_tag.bytes);
+      return -1;
+    } else if (status == AMQP_STATUS_OK &&
+               handle_blocked_frame(conn, &frame)) {
+      /* Send any messages held back while we were blocked. */
+      if (!conn->blocked && flush_publishes(conn, buffer, len) < 0) {
+        return -1;
+      }
+      return 0;
+    } else if (status == AMQP_STATUS_OK) {
+      status = AMQP_STATUS_UNEXPECTED_STATE;
+    } else {
+      /* Act on whatever status amqp_simple_wait_frame() gave us. */
+    }
+  }
+
+  switch (status) {
+  case AMQP_STATUS_TIMEOUT:
+    /* OK. */
+    return 0;
+  case AMQP_STATUS_CONNECTION_CLOSED:
+    /* fallthrough */
+  case AMQP_STATUS_SOCKET_CLOSED:
+    /* fallthrough */
+  case AMQP_STATUS_SOCKET_ERROR:
+    conn->is_connected = 0;
+    /* Consumers are restarted when the connection is recovered, so we can
+       just carry on. */
+    if (conn->recover && !conn->recovering &&
+        reconnect_with_backoff(conn, buffer, len) == 0) {
+      return 0;
+    }
+    snprintf(buffer, len, "Disconnected from server.");
+    return -1;
+  default:
+    snprintf(buffer, len, "Encountered unexpected library error: %s",
+             amqp_error_string2(status));
+    return -1;
+  }
+}
+
+int consume_message(connection *conn, struct timeval *tv, char *buffer,
+                    size_t len)
+{
+  amqp_rpc_reply_t reply;
+  amqp_envelope_t env;
+  consumer *elt;
+  SEXP message, body;
+
+  amqp_maybe_release_buffers(conn->conn);
+  reply = amqp_consume_message(conn->conn, &env, tv, 0);
+
+  if (reply.reply_type == AMQP_RESPONSE_LIBRARY_EXCEPTION) {
+    return handle_consume_error(conn, reply.library_error, buffer, len);
+  }
+
+  if (reply.reply_type != AMQP_RESPONSE_NORMAL) {
+    return 0;
+  }
+
+  /* The envelope contains a message. Find the right consumer. */
+  elt = conn->consumers;
+  while (elt && strncmp(elt->tag.bytes, env.consumer_tag.bytes,
+                        elt->tag.len) != 0) {
+    elt = elt->next;
+  }
+  if (!elt) {
+    /* Quietly swallow messages sent to now-cancelled consumers. */
+    amqp_destroy_envelope(&env);
+    return 1;
+  }
+
+  if (elt->filter && !filter_matches(elt->filter, &env)) {
+    /* Discard filtered messages without involving R at all. */
+    int status = elt->spec.no_ack ? AMQP_STATUS_OK :
+      discard_message(conn->conn, elt->chan.chan, elt->filter,
+                      env.delivery_tag);
+    if (status != AMQP_STATUS_OK) {
+      amqp_destroy_envelope(&env);
+      render_amqp_library_error(status, conn, &elt->chan, buffer, len);
+      return -1;
+    }
+    if (!elt->spec.no_ack) {
+      mark_settled(&elt->chan, env.delivery_tag, 0);
+    }
+    amqp_destroy_envelope(&env);
+    return 1;
+  }
+
+  /* Copy body. */
+  size_t body_len = env.message.body.len;
+  body = PROTECT(Rf_allocVector(RAWSXP, body_len));
+  memcpy((void *) RAW(body), env.message.body.bytes, body_len);
+
+  message = PROTECT(R_message_object(body, env.delivery_tag, env.redelivered,
+                                     env.exchange, env.routing_key, -1,
+                                     env.consumer_tag,
+                                     &env.message.properties, conn));
+  amqp_destroy_envelope(&env);
+
+  /* Release the connection while R code runs, so that it can be serviced by
+     the heartbeat thread (if any). */
+  SETCADR(elt->fcall, message);
+  conn_unlock(conn);
+  Rf_eval(elt->fcall, elt->rho);
+  conn_lock(conn);
+
+  UNPROTECT(2);
+  return 1;
+}
+
 SEXP R_amqp_listen(SEXP ptr, SEXP timeout)
 {
   connection *conn = (connection *) R_ExternalPtrAddr(ptr);
   char errbuff[200];
+  conn_lock(conn);
   if (ensure_valid_channel(conn, &conn->chan, errbuff, 200) < 0) {
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to consume messages. %s", errbuff);
     return R_NilValue;
   }
 
   if (!conn->consumers) {
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("No consumers are declared on this connection.");
   }
 
@@ -147,103 +331,120 @@ SEXP R_amqp_listen(SEXP ptr, SEXP timeout)
   tv.tv_usec = 0;
   time_t start = time(NULL);
 
-  SEXP message, body, R_fcall;
-
-  amqp_rpc_reply_t reply;
-  amqp_envelope_t env;
-  consumer *elt;
-
   while (current_wait < max_wait) {
-
-    amqp_maybe_release_buffers(conn->conn);
-    reply = amqp_consume_message(conn->conn, &env, &tv, 0);
-
     /* Accumulate timeouts one second at a time until we hit the max. This is to
      * make the loop more responsive and give the user the ability to interrupt
      * the function early. */
+    if (consume_message(conn, &tv, errbuff, 200) < 0) {
+      conn_unlock(conn);
+      raise_warnings(conn);
+      Rf_error("%s", errbuff);
+    }
 
-    if (reply.reply_type == AMQP_RESPONSE_LIBRARY_EXCEPTION) {
-      int status = reply.library_error;
-
-      /* If we get into an unexpected state, try to decode a relevant method
-         (e.g. connection.close). */
-      if (status == AMQP_STATUS_UNEXPECTED_STATE) {
-        amqp_frame_t frame;
-        status = amqp_simple_wait_frame(conn->conn, &frame);
-        /* If the server shuts down gracefully, this is how we will probably be
-           notified. */
-        if (status == AMQP_STATUS_OK && frame.frame_type == AMQP_FRAME_METHOD &&
-            frame.payload.method.id == AMQP_CONNECTION_CLOSE_METHOD) {
-          status = AMQP_STATUS_CONNECTION_CLOSED;
-        } else if (status == AMQP_STATUS_OK &&
-                   frame.frame_type == AMQP_FRAME_METHOD &&
-                   frame.payload.method.id == AMQP_BASIC_CANCEL_METHOD) {
-          /* If we have consumer_cancel_notify enabled, this is how we are
-             notified that e.g. deleted queues have cancelled a consumer. */
-          amqp_basic_cancel_t *cancel;
-          cancel = (amqp_basic_cancel_t *) frame.payload.method.decoded;
-          char tag[128];
-          strncpy(tag, (const char *) cancel->consumer_tag.bytes,
-                  cancel->consumer_tag.len);
-          tag[cancel->consumer_tag.len] = '\0';
-          Rf_error("Consumer '%s' cancelled by the broker.", tag);
-        } else if (status == AMQP_STATUS_OK) {
-          status = AMQP_STATUS_UNEXPECTED_STATE;
-        } else {
-          /* Act on whatever status amqp_simple_wait_frame() gave us. */
-        }
-      }
+    current_wait = time(NULL) - start;
+    conn_unlock(conn);
+    raise_warnings(conn);
+    R_CheckUserInterrupt(); // Escape hatch.
+    conn_lock(conn);
+  }
 
-      switch (status) {
-      case AMQP_STATUS_TIMEOUT:
-        /* OK. */
-        break;
-      case AMQP_STATUS_CONNECTION_CLOSED:
-        /* fallthrough */
-      case AMQP_STATUS_SOCKET_CLOSED:
-        /* fallthrough */
-      case AMQP_STATUS_SOCKET_ERROR:
-        /* fallthrough */
-        conn->is_connected = 0;
-        Rf_error("Disconnected from server.");
-        break;
-      default:
-        Rf_error("Encountered unexpected library error: %s\n",
-                 amqp_error_string2(status));
-        break;
-      }
+  conn_unlock(conn);
+  raise_warnings(conn);
+  return R_NilValue;
+}
+
+static int has_buffered_frames(connection *conn)
+{
+  return amqp_frames_enqueued(conn->conn) || amqp_data_in_buffer(conn->conn);
+}
+
+SEXP R_amqp_listen_all(SEXP ptrs, SEXP timeout)
+{
+  int len = Rf_length(ptrs), active = 0;
+  connection **conns = (connection **) R_alloc(len, sizeof(connection *));
+  struct pollfd *fds = (struct pollfd *) R_alloc(len, sizeof(struct pollfd));
+  connection *conn;
+  char errbuff[200];
+  int res;
+
+  for (int i = 0; i < len; i++) {
+    conn = (connection *) R_ExternalPtrAddr(VECTOR_ELT(ptrs, i));
+    conn_lock(conn);
+    res = ensure_valid_channel(conn, &conn->chan, errbuff, 200);
+    conn_unlock(conn);
+    raise_warnings(conn);
+    if (res < 0) {
+      Rf_error("Failed to consume messages on connection %d. %s", i + 1,
+               errbuff);
+    }
+    /* Connections without consumers have nothing to listen for. */
+    if (conn->consumers) {
+      conns[active++] = conn;
     }
+  }
 
-    /* The envelope contains a message. */
+  if (!active) {
+    Rf_error("No consumers are declared on these connections.");
+  }
 
-    if (reply.reply_type == AMQP_RESPONSE_NORMAL) {
-      /* Find the right consumer. */
-      elt = conn->consumers;
-      while (elt && strncmp(elt->tag.bytes, env.consumer_tag.bytes,
-                            elt->tag.len) != 0) {
-        elt = elt->next;
-      }
-      if (!elt) {
-        /* Quietly swallow messages sent to now-cancelled consumers. */
-        amqp_destroy_envelope(&env);
-        continue;
-      }
+  int current_wait = 0, max_wait = asInteger(timeout), ready, drained;
+  max_wait = max_wait > 60 ? 60 : max_wait;
+  struct timeval tv;
+  tv.tv_sec = 0;
+  tv.tv_usec = 0;
+  time_t start = time(NULL);
 
-      /* Copy body. */
-      size_t body_len = env.message.body.len;
-      body = PROTECT(Rf_allocVector(RAWSXP, body_len));
-      memcpy((void *) RAW(body), env.message.body.bytes, body_len);
+  while (current_wait < max_wait) {
+    /* Frames that have already been read from the socket won't make it
+       readable, so handle them before waiting. */
+    drained = 0;
+    for (int i = 0; i < active; i++) {
+      conn = conns[i];
+      conn_lock(conn);
+      while (conn->is_connected && has_buffered_frames(conn)) {
+        res = consume_message(conn, &tv, errbuff, 200);
+        if (res < 0) {
+          conn_unlock(conn);
+          raise_warnings(conn);
+          Rf_error("%s", errbuff);
+        } else if (res == 0) {
+          /* Only part of a frame is available. */
+          break;
+        }
+        drained = 1;
+      }
+      conn_unlock(conn);
+      raise_warnings(conn);
+    }
 
-      message = PROTECT(R_message_object(body, env.delivery_tag, env.redelivered,
-                                         env.exchange, env.routing_key, -1,
-                                         env.consumer_tag,
-                                         &env.message.properties));
-      amqp_destroy_envelope(&env);
+    if (!drained) {
+      for (int i = 0; i < active; i++) {
+        if (!conns[i]->is_connected) {
+          Rf_error("Failed to consume messages. Not connected to a server.");
+        }
+        fds[i].fd = amqp_get_sockfd(conns[i]->conn);
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+      }
 
-      SETCADR(elt->fcall, message);
-      Rf_eval(elt->fcall, elt->rho);
+      /* As in amqp_listen(), wait at most one second at a time so that the
+         user has the opportunity to interrupt. */
+      ready = poll(fds, active, 1000);
+      if (ready < 0 && errno != EINTR) {
+        Rf_error("Failed to wait for messages. %s", strerror(errno));
+      }
 
-      UNPROTECT(2);
+      for (int i = 0; ready > 0 && i < active; i++) {
+        if (!fds[i].revents || !conns[i]->is_connected) continue;
+        /* Errors and hangups will be reported by the library. */
+        conn_lock(conns[i]);
+        res = consume_message(conns[i], &tv, errbuff, 200);
+        conn_unlock(conns[i]);
+        raise_warnings(conns[i]);
+        if (res < 0) {
+          Rf_error("%s", errbuff);
+        }
+      }
     }
 
     current_wait = time(NULL) - start;
@@ -11,22 +11,65 @@
 
 #include "utils.h"
 
+/* Envelopes waiting to be handled by a consumer on the main thread. */
+typedef struct pending_env {
+  amqp_envelope_t env;
+  struct pending_env *next;
+} pending_env;
+
 typedef struct bg_consumer {
   bg_conn *conn;
   channel chan;
   amqp_bytes_t tag;
+  consumer_spec spec;
+  message_filter *filter;
+  SEXP filter_ptr;
   int no_ack;
+  int has_fun;
   SEXP fun;
   SEXP rho;
+  SEXP loop;
+  int loop_id;
+  int max_per_tick;
+  pending_env *head;
+  pending_env *tail;
+  int drain_scheduled;
+  longears_message_handler handler;
+  void *handler_data;
+  longears_handler_finalizer handler_finalizer;
   struct bg_consumer *next;
   struct bg_consumer *prev;
 } bg_consumer;
 
 typedef struct {
   bg_conn *conn;
-  amqp_envelope_t *env;
+  amqp_bytes_t tag;
 } callback_data;
 
+static bg_consumer * find_bg_consumer(bg_conn *conn, amqp_bytes_t tag)
+{
+  bg_consumer *elt = conn->consumers;
+  while (elt && (elt->tag.len != tag.len ||
+                 strncmp((const char *) elt->tag.bytes,
+                         (const char *) tag.bytes, elt->tag.len) != 0)) {
+    elt = elt->next;
+  }
+  return elt;
+}
+
+static void later_callback(void *data);
+
+/* Schedule a callback on the consumer's event loop to handle pending messages.
+   Must be called with the mutex held. */
+static void schedule_drain(bg_consumer *con)
+{
+  callback_data *cdata = (callback_data *) malloc(sizeof(callback_data));
+  cdata->conn = con->conn;
+  cdata->tag = amqp_bytes_malloc_dup(con->tag);
+  con->drain_scheduled = 1;
+  later::later(later_callback, cdata, 0, con->loop_id);
+}
+
 static void R_finalize_bg_consumer(SEXP ptr)
 {
   bg_consumer *con = (bg_consumer *) R_ExternalPtrAddr(ptr);
@@ -45,9 +88,7 @@ static void R_finalize_bg_consumer(SEXP ptr)
         char errbuff[200];
         render_amqp_error(reply, con->conn->conn, &con->chan, errbuff, 200);
       } else {
-        /* TODO: This may not be necessary. */
-        amqp_maybe_release_buffers_on_channel(con->conn->conn->conn,
-                                              con->chan.chan);
+        release_channel(con->conn->conn, &con->chan);
       }
     }
 
@@ -60,14 +101,29 @@ static void R_finalize_bg_consumer(SEXP ptr)
     } else if (con->conn->consumers == con) {
       con->conn->consumers = con->next;
     }
+    con->conn->consumer_count--;
 
     pthread_mutex_unlock(&con->conn->mutex);
   }
 
   if (con) {
+    /* Drop any messages that have not been handled yet. */
+    pending_env *next, *elt = con->head;
+    while (elt) {
+      next = elt->next;
+      amqp_destroy_envelope(&elt->env);
+      free(elt);
+      elt = next;
+    }
+    if (con->handler_finalizer) {
+      con->handler_finalizer(con->handler_data);
+    }
     amqp_bytes_free(con->tag);
+    destroy_consumer_spec(&con->spec);
     R_ReleaseObject(con->fun);
     R_ReleaseObject(con->rho);
+    R_ReleaseObject(con->loop);
+    R_ReleaseObject(con->filter_ptr);
     free(con);
     con = NULL;
   }
@@ -77,56 +133,76 @@ static void R_finalize_bg_consumer(SEXP ptr)
 static void later_callback(void *data)
 {
   callback_data *cdata = (callback_data *) data;
-
-  /* Find the consumer for the envelope. */
-
-  bg_consumer *elt = (bg_consumer *) cdata->conn->consumers;
-  while (elt && strncmp((const char *) elt->tag.bytes,
-                        (const char *) cdata->env->consumer_tag.bytes,
-                        elt->tag.len) != 0) {
-    elt = elt->next;
-  }
-  if (!elt) {
-    /* Quietly swallow messages sent to now-cancelled consumers. */
-    amqp_destroy_envelope(cdata->env);
-    free(cdata->env);
-    free(cdata);
-    return;
+  bg_conn *conn = cdata->conn;
+  bg_consumer *elt;
+  pending_env *node;
+
+  int max_messages = 0;
+  pthread_mutex_lock(&conn->mutex);
+  elt = find_bg_consumer(conn, cdata->tag);
+  if (elt) {
+    elt->drain_scheduled = 0;
+    max_messages = elt->max_per_tick;
   }
+  pthread_mutex_unlock(&conn->mutex);
+
+  /* Handle at most max_per_tick messages before yielding to the event loop, so
+     that other callbacks get a chance to run. Note that the consumer may be
+     cancelled by one of its own callbacks, so we need to look it up again each
+     time. */
+  for (int i = 0; i < max_messages; i++) {
+    pthread_mutex_lock(&conn->mutex);
+    elt = find_bg_consumer(conn, cdata->tag);
+    if (!elt || !elt->head) {
+      /* Either the consumer has been cancelled or there is nothing to do. */
+      pthread_mutex_unlock(&conn->mutex);
+      break;
+    }
+    node = elt->head;
+    elt->head = node->next;
+    if (!elt->head) {
+      elt->tail = NULL;
+    } else if (!elt->drain_scheduled) {
+      /* Do this up front in case the callback fails. */
+      schedule_drain(elt);
+    }
 
-  /* Acknowledge message receipt. TODO: Can we n'ack messages for cancelled
-     consumers swallowed above? */
-  if (!elt->no_ack) {
-    pthread_mutex_lock(&cdata->conn->mutex);
-    int ack = amqp_basic_ack(cdata->conn->conn->conn, elt->chan.chan,
-                             cdata->env->delivery_tag, 0);
-    if (ack != AMQP_STATUS_OK) {
-      Rf_warning("Failed to acknowledge message. %s", amqp_error_string2(ack));
+    /* Acknowledge message receipt. TODO: Can we n'ack messages for cancelled
+       consumers swallowed above? */
+    if (!elt->no_ack) {
+      int ack = amqp_basic_ack(conn->conn->conn, elt->chan.chan,
+                               node->env.delivery_tag, 0);
+      if (ack != AMQP_STATUS_OK) {
+        Rf_warning("Failed to acknowledge message. %s", amqp_error_string2(ack));
+      }
     }
-    pthread_mutex_unlock(&cdata->conn->mutex);
+    pthread_mutex_unlock(&conn->mutex);
+
+    /* Create R-level message object. */
+    size_t body_len = node->env.message.body.len;
+    SEXP body = PROTECT(Rf_allocVector(RAWSXP, body_len));
+    memcpy((void *) RAW(body), node->env.message.body.bytes, body_len);
+
+    SEXP message = PROTECT(R_message_object(body, node->env.delivery_tag,
+                                            node->env.redelivered,
+                                            node->env.exchange,
+                                            node->env.routing_key, -1,
+                                            node->env.consumer_tag,
+                                            &node->env.message.properties,
+                                            conn->conn));
+    amqp_destroy_envelope(&node->env);
+    free(node);
+
+    SEXP R_fcall = PROTECT(Rf_allocList(2));
+    SET_TYPEOF(R_fcall, LANGSXP);
+    SETCAR(R_fcall, elt->fun);
+    SETCADR(R_fcall, message);
+    Rf_eval(R_fcall, elt->rho);
+
+    UNPROTECT(3);
   }
 
-  /* Create R-level message object. */
-  size_t body_len = cdata->env->message.body.len;
-  SEXP body = PROTECT(Rf_allocVector(RAWSXP, body_len));
-  memcpy((void *) RAW(body), cdata->env->message.body.bytes, body_len);
-
-  SEXP message = PROTECT(R_message_object(body, cdata->env->delivery_tag,
-                                          cdata->env->redelivered,
-                                          cdata->env->exchange,
-                                          cdata->env->routing_key, -1,
-                                          cdata->env->consumer_tag,
-                                          &cdata->env->message.properties));
-
-  SEXP R_fcall = PROTECT(Rf_allocList(2));
-  SET_TYPEOF(R_fcall, LANGSXP);
-  SETCAR(R_fcall, elt->fun);
-  SETCADR(R_fcall, message);
-  Rf_eval(R_fcall, elt->rho);
-
-  UNPROTECT(3);
-  amqp_destroy_envelope(cdata->env);
-  free(cdata->env);
+  amqp_bytes_free(cdata->tag);
   free(cdata);
   return;
 }
@@ -134,7 +210,8 @@ static void later_callback(void *data)
 enum bg_consumer_err {
   BG_ERR_DISCONNECTED,
   BG_ERR_UNEXPECTED_STATUS,
-  BG_ERR_CONSUMER_CANCEL
+  BG_ERR_CONSUMER_CANCEL,
+  BG_ERR_CONSUMER_RECOVERY
 };
 
 struct bg_consumer_err_data {
@@ -170,10 +247,73 @@ static void later_warn_callback(void *data)
       Rf_warning("Consumer '%s' cancelled by the broker.", tag);
     }
     break;
+  case BG_ERR_CONSUMER_RECOVERY:
+    {
+      char tag[128];
+      strncpy(tag, (const char *) err->payload.tag.bytes, err->payload.tag.len);
+      tag[err->payload.tag.len] = '\0';
+      amqp_bytes_free(err->payload.tag);
+      free(err);
+      Rf_warning("Failed to recover background consumer '%s'.", tag);
+    }
+    break;
   }
   return;
 }
 
+/* Try to re-establish the connection and restart all consumers. This must be
+   called with the mutex held, though it is released while waiting between
+   attempts so that the main thread can make progress. */
+static int recover_bg_conn(bg_conn *con)
+{
+  struct timespec sleeptime;
+  char errbuff[200];
+  double delay;
+  int res = -1;
+
+  for (int i = 0; i < con->conn->recover_attempts && res < 0; i++) {
+    delay = backoff_delay(con->conn, i);
+    sleeptime.tv_sec = (time_t) delay;
+    sleeptime.tv_nsec = (long) ((delay - sleeptime.tv_sec) * 1e9);
+    pthread_mutex_unlock(&con->mutex);
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    nanosleep(&sleeptime, NULL);
+    pthread_testcancel();
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_mutex_lock(&con->mutex);
+    res = lconnect(con->conn, errbuff, 200);
+  }
+  if (res < 0) return -1;
+
+  bg_consumer *elt = con->consumers;
+  while (elt) {
+    /* Messages still waiting to be acknowledged will be redelivered, and we
+       could not acknowledge them on a new channel anyway. */
+    if (!elt->no_ack) {
+      pending_env *next, *node = elt->head;
+      while (node) {
+        next = node->next;
+        amqp_destroy_envelope(&node->env);
+        free(node);
+        node = next;
+      }
+      elt->head = NULL;
+      elt->tail = NULL;
+    }
+    if (restart_consumer(con->conn, &elt->chan, elt->tag, &elt->spec, errbuff,
+                         200) < 0) {
+      struct bg_consumer_err_data *cdata;
+      cdata = (struct bg_consumer_err_data *) malloc(sizeof(struct bg_consumer_err_data));
+      cdata->kind = BG_ERR_CONSUMER_RECOVERY;
+      cdata->payload.tag = amqp_bytes_malloc_dup(elt->tag);
+      later::later(later_warn_callback, (void *) cdata, 0);
+    }
+    elt = elt->next;
+  }
+
+  return 0;
+}
+
 static void * consume_run(void *data)
 {
   bg_conn *con = (bg_conn *) data;
@@ -194,7 +334,7 @@ static void * consume_run(void *data)
 
   amqp_rpc_reply_t reply;
   amqp_envelope_t *env;
-  callback_data *ptr;
+  pending_env *node;
   struct bg_consumer_err_data *cdata;
 
   for (;;) {
@@ -214,16 +354,61 @@ static void * consume_run(void *data)
 
     /* TODO: Is this still safe? Does the callback rely on memory that is released here? */
     amqp_maybe_release_buffers(con->conn->conn);
-    env = (amqp_envelope_t *) malloc(sizeof(amqp_envelope_t));
+    node = (pending_env *) malloc(sizeof(pending_env));
+    node->next = NULL;
+    env = &node->env;
     reply = amqp_consume_message(con->conn->conn, env, &tv, 0);
 
-    /* If the envelope contains a message, schedule a callback. Note that the callback
-     * is responsible for releasing the memory of both (1) ptr; and (2) env. */
+    /* If the envelope contains a message, add it to the consumer's queue and
+     * schedule a callback if there isn't one already. Note that the callback is
+     * responsible for releasing the memory of the envelope. */
     if (reply.reply_type == AMQP_RESPONSE_NORMAL) {
-      ptr = (callback_data *) malloc(sizeof(callback_data));
-      ptr->conn = con;
-      ptr->env = env;
-      later::later(later_callback, ptr, 0);
+      bg_consumer *elt = find_bg_consumer(con, env->consumer_tag);
+      if (!elt) {
+        /* Quietly swallow messages sent to now-cancelled consumers. */
+        amqp_destroy_envelope(env);
+        free(node);
+      } else if (elt->filter && !filter_matches(elt->filter, env)) {
+        /* Discard filtered messages before they reach R or native
+           handlers. */
+        int status = elt->no_ack ? AMQP_STATUS_OK :
+          discard_message(con->conn->conn, elt->chan.chan, elt->filter,
+                          env->delivery_tag);
+        if (status != AMQP_STATUS_OK) {
+          cdata = (struct bg_consumer_err_data *) malloc(sizeof(struct bg_consumer_err_data));
+          cdata->kind = BG_ERR_UNEXPECTED_STATUS;
+          cdata->payload.status = status;
+          later::later(later_warn_callback, (void *) cdata, 0);
+        }
+        amqp_destroy_envelope(env);
+        free(node);
+      } else if (elt->handler && (!elt->handler(env, elt->handler_data) ||
+                                  !elt->has_fun)) {
+        /* Handled natively (or there is no R callback to forward it to), so
+           there's no need to involve R at all. */
+        int status = elt->no_ack ? AMQP_STATUS_OK :
+          amqp_basic_ack(con->conn->conn, elt->chan.chan, env->delivery_tag, 0);
+        if (status != AMQP_STATUS_OK) {
+          cdata = (struct bg_consumer_err_data *) malloc(sizeof(struct bg_consumer_err_data));
+          cdata->kind = BG_ERR_UNEXPECTED_STATUS;
+          cdata->payload.status = status;
+          later::later(later_warn_callback, (void *) cdata, 0);
+        }
+        amqp_destroy_envelope(env);
+        free(node);
+      } else {
+        if (elt->tail) {
+          elt->tail->next = node;
+        } else {
+          elt->head = node;
+        }
+        elt->tail = node;
+        /* Consumers without an R callback hold on to messages until a native
+           handler is attached. */
+        if (elt->has_fun && !elt->drain_scheduled) {
+          schedule_drain(elt);
+        }
+      }
     } else if (reply.reply_type == AMQP_RESPONSE_LIBRARY_EXCEPTION) {
       int status = reply.library_error;
 
@@ -264,8 +449,7 @@ static void * consume_run(void *data)
             reply = amqp_channel_close(con->conn->conn, elt->chan.chan,
                                        AMQP_REPLY_SUCCESS);
             if (reply.reply_type == AMQP_RESPONSE_NORMAL) {
-              amqp_maybe_release_buffers_on_channel(con->conn->conn,
-                                                    elt->chan.chan);
+              release_channel(con->conn, &elt->chan);
               status = AMQP_STATUS_OK;
             } else if (reply.reply_type == AMQP_RESPONSE_LIBRARY_EXCEPTION) {
               status = reply.library_error;
@@ -274,6 +458,10 @@ static void * consume_run(void *data)
               status = AMQP_STATUS_UNEXPECTED_STATE;
             }
           }
+        } else if (status == AMQP_STATUS_OK &&
+                   handle_blocked_frame(con->conn, &frame)) {
+          /* Nothing is published on background connections. */
+          status = AMQP_STATUS_OK;
         } else if (status == AMQP_STATUS_OK) {
           status = AMQP_STATUS_UNEXPECTED_STATE;
         } else {
@@ -295,7 +483,11 @@ static void * consume_run(void *data)
       case AMQP_STATUS_SOCKET_ERROR:
         con->conn->is_connected = 0;
         amqp_destroy_envelope(env);
-        free(env);
+        free(node);
+        if (con->recover && recover_bg_conn(con) == 0) {
+          break;
+        }
+        con->running = 0;
         pthread_mutex_unlock(&con->mutex);
         cdata = (struct bg_consumer_err_data *) malloc(sizeof(struct bg_consumer_err_data));
         cdata->kind = BG_ERR_DISCONNECTED;
@@ -306,7 +498,7 @@ static void * consume_run(void *data)
       case AMQP_STATUS_TIMEOUT:
         /* Nothing to consume right now. */
         amqp_destroy_envelope(env);
-        free(env);
+        free(node);
         break;
       default:
         /* Warn on other errors. */
@@ -315,13 +507,13 @@ static void * consume_run(void *data)
         cdata->payload.status = status;
         later::later(later_warn_callback, (void *) cdata, 0);
         amqp_destroy_envelope(env);
-        free(env);
+        free(node);
         break;
       }
     } else {
       /* FIXME: Can this ever happen? What should we do if it does? */
       amqp_destroy_envelope(env);
-      free(env);
+      free(node);
     }
 
     /* Allow the thread to be cancelled here. */
@@ -336,33 +528,96 @@ static void * consume_run(void *data)
 connection *clone_connection(const connection *old)
 {
   connection *conn = (connection *) malloc(sizeof(connection));
-  conn->host = old->host;
-  conn->port = old->port;
+  conn->hosts = (const char **) malloc(old->host_count * sizeof(const char *));
+  conn->ports = (int *) malloc(old->host_count * sizeof(int));
+  memcpy(conn->hosts, old->hosts, old->host_count * sizeof(const char *));
+  memcpy(conn->ports, old->ports, old->host_count * sizeof(int));
+  conn->host_count = old->host_count;
+  conn->host_index = old->host_index;
   conn->vhost = old->vhost;
   conn->username = old->username;
   conn->password = old->password;
   conn->name = old->name;
   conn->timeout = old->timeout;
+  conn->requested_channels = old->requested_channels;
+  conn->frame_max = old->frame_max;
+  conn->heartbeat_interval = old->heartbeat_interval;
+  conn->tcp_nodelay = old->tcp_nodelay;
+  conn->sndbuf = old->sndbuf;
+  conn->rcvbuf = old->rcvbuf;
+  conn->tls = old->tls;
   conn->chan.chan = 0;
   conn->chan.is_open = 0;
-  conn->next_chan = 1;
+  conn->channels = NULL;
+  conn->channel_max = 0;
   conn->consumers = NULL;
-  conn->bg_conn = NULL;
+  conn->api_consumers = 0;
+  conn->bg_conns = NULL;
+  conn->bg_threads = 0;
+  conn->listening = 0;
+  conn->loop_id = 0;
+  conn->max_per_tick = 0;
+  conn->pending_callbacks = 0;
+  conn->lock_count = 0;
+  conn->has_heartbeat = 0;
+  /* Background connections recover on their own in consume_run(). */
+  conn->recover = 0;
+  conn->recover_attempts = old->recover_attempts;
+  conn->recover_backoff = old->recover_backoff;
+  conn->recovering = 0;
+  conn->connecting = 0;
+  conn->topology = NULL;
+  conn->blocked = 0;
+  conn->blocked_reason[0] = '\0';
+  conn->blocked_since = 0;
+  conn->blocked_seconds = 0;
+  conn->blocked_count = 0;
+  conn->pending_head = NULL;
+  conn->pending_tail = NULL;
+  conn->pending_count = 0;
+  conn->pending_bytes = 0;
+  conn->warnings = NULL;
+  /* Messages are only decoded on the main thread, so background connections
+     can share the string cache, which outlives them. */
+  conn->strings = old->strings;
   conn->is_connected = 0;
   conn->conn = NULL;
+  init_conn_mutex(conn);
 
   return (connection *) conn;
 }
 
-extern "C" int init_bg_conn(connection *conn)
+extern "C" int select_bg_conn(const connection *conn)
 {
-  bg_conn *con = conn->bg_conn;
+  /* Prefer threads that have not been started (or have no consumers) yet, and
+     otherwise pick the least-loaded one. Consumer counts are only modified on
+     the main thread, so we don't need to lock anything here. */
+  int best = 0, best_count = -1;
+  for (int i = 0; i < conn->bg_threads; i++) {
+    bg_conn *con = conn->bg_conns ? conn->bg_conns[i] : NULL;
+    int count = con ? con->consumer_count : 0;
+    if (best_count < 0 || count < best_count) {
+      best = i;
+      best_count = count;
+    }
+  }
+  return best;
+}
+
+extern "C" int init_bg_conn(connection *conn, int index)
+{
+  if (!conn->bg_conns) {
+    conn->bg_conns = (bg_conn **) calloc(conn->bg_threads, sizeof(bg_conn *));
+  }
+
+  bg_conn *con = conn->bg_conns[index];
   if (con) {
-    /* If the connection has been marked as closed by the background thread, we
-       need to clean up and start again. TODO: Do we need to lock the mutex here
-       to safely check the connection state? */
-    if (!con->conn->is_connected) {
-      destroy_bg_conn(conn->bg_conn);
+    /* If the background thread has given up on the connection, we need to
+       clean up and start again. TODO: Do we need to lock the mutex here to
+       safely check the thread state? */
+    if (!con->running) {
+      destroy_bg_conn(con);
+      conn->bg_conns[index] = NULL;
     } else {
       return 0;
     }
@@ -373,18 +628,27 @@ extern "C" int init_bg_conn(connection *conn)
   /* Need to do this before pthread_create() to avoid a data race on
      fields in out. */
   out->conn = clone_connection(conn);
+  /* Spread background connections across the other endpoints, if any. */
+  out->conn->host_index = (conn->host_index + index) % conn->host_count;
   out->mutex = PTHREAD_MUTEX_INITIALIZER;
   out->consumers = NULL;
+  out->consumer_count = 0;
+  out->running = 1;
+  out->recover = conn->recover;
 
   int res = pthread_create(&out->thread, NULL, consume_run, out);
   if (res != 0) {
     amqp_destroy_connection(out->conn->conn);
+    pthread_mutex_destroy(&out->conn->mutex);
+    free(out->conn->channels);
+    free(out->conn->hosts);
+    free(out->conn->ports);
     free(out->conn);
     free(out);
     return res;
   }
 
-  conn->bg_conn = out;
+  conn->bg_conns[index] = out;
   return 0;
 }
 
@@ -417,6 +681,10 @@ extern "C" void destroy_bg_conn(bg_conn *conn)
   }
 
   amqp_destroy_connection(conn->conn->conn);
+  pthread_mutex_destroy(&conn->conn->mutex);
+  free(conn->conn->channels);
+  free(conn->conn->hosts);
+  free(conn->conn->ports);
   free(conn->conn);
   free(conn);
   conn = NULL;
@@ -426,7 +694,9 @@ extern "C" void destroy_bg_conn(bg_conn *conn)
 
 extern "C" SEXP R_amqp_consume_later(SEXP ptr, SEXP queue, SEXP fun, SEXP rho,
                                      SEXP consumer, SEXP no_ack, SEXP exclusive,
-                                     SEXP prefetch_count_, SEXP args)
+                                     SEXP prefetch_count_, SEXP args,
+                                     SEXP thread, SEXP loop,
+                                     SEXP max_per_tick, SEXP filter)
 {
 
   amqp_bytes_t queue_str = charsxp_to_amqp_bytes(Rf_asChar(queue));
@@ -435,15 +705,32 @@ extern "C" SEXP R_amqp_consume_later(SEXP ptr, SEXP queue, SEXP fun, SEXP rho,
   int is_exclusive = Rf_asLogical(exclusive);
   // convert the parameter to int
   int prefetch_count = Rf_asInteger(prefetch_count_);
+  int loop_id = Rf_asInteger(Rf_findVarInFrame(loop, Rf_install("id")));
+  int max_messages = Rf_asInteger(max_per_tick);
+  if (max_messages == NA_INTEGER || max_messages < 1) {
+    Rf_error("The maximum number of messages per tick must be positive.");
+  }
 
   amqp_table_t *arg_table = (amqp_table_t *) R_ExternalPtrAddr(args);
 
   connection *conn = (connection *) R_ExternalPtrAddr(ptr);
-  int res = init_bg_conn(conn);
+
+  /* Either use the requested thread or pick the least-loaded one. */
+  int index = Rf_isNull(thread) ? NA_INTEGER : Rf_asInteger(thread);
+  if (index == NA_INTEGER) {
+    index = select_bg_conn(conn);
+  } else if (index < 1 || index > conn->bg_threads) {
+    Rf_error("Invalid background thread %d. This connection has %d.", index,
+             conn->bg_threads);
+  } else {
+    index--;
+  }
+
+  int res = init_bg_conn(conn, index);
   if (res != 0) {
     Rf_error("Failed to create background thread. Error: %d.", res);
   }
-  bg_conn *bg_conn = conn->bg_conn;
+  bg_conn *bg_conn = conn->bg_conns[index];
 
   pthread_mutex_lock(&bg_conn->mutex);
 
@@ -455,13 +742,28 @@ extern "C" SEXP R_amqp_consume_later(SEXP ptr, SEXP queue, SEXP fun, SEXP rho,
   char errbuff[1000];
   if (lconnect(bg_conn->conn, errbuff, 1000) < 0 ||
       ensure_valid_channel(bg_conn->conn, &con->chan, errbuff, 1000) < 0) {
+    free(con);
+    pthread_mutex_unlock(&bg_conn->mutex);
     Rf_error("Failed to clone connection. %s", errbuff);
     return R_NilValue;
   }
 
+  con->filter = Rf_isNull(filter) ? NULL
+                                  : (message_filter *) R_ExternalPtrAddr(filter);
+  con->filter_ptr = filter;
   con->no_ack = has_no_ack;
+  con->has_fun = !Rf_isNull(fun);
   con->fun = fun;
   con->rho = rho;
+  con->loop = loop;
+  con->loop_id = loop_id;
+  con->max_per_tick = max_messages;
+  con->head = NULL;
+  con->tail = NULL;
+  con->drain_scheduled = 0;
+  con->handler = NULL;
+  con->handler_data = NULL;
+  con->handler_finalizer = NULL;
   con->prev = NULL;
   con->next = NULL;
 
@@ -482,8 +784,10 @@ extern "C" SEXP R_amqp_consume_later(SEXP ptr, SEXP queue, SEXP fun, SEXP rho,
     if (con->chan.is_open) {
       amqp_channel_close(bg_conn->conn->conn, con->chan.chan,
                          AMQP_REPLY_SUCCESS);
+      release_channel(bg_conn->conn, &con->chan);
     }
     free(con);
+    pthread_mutex_unlock(&bg_conn->mutex);
 
     Rf_error("Failed to set quality of service. %s", errbuff);
   }
@@ -501,18 +805,24 @@ extern "C" SEXP R_amqp_consume_later(SEXP ptr, SEXP queue, SEXP fun, SEXP rho,
     if (con->chan.is_open) {
       amqp_channel_close(bg_conn->conn->conn, con->chan.chan,
                          AMQP_REPLY_SUCCESS);
+      release_channel(bg_conn->conn, &con->chan);
     }
     free(con);
+    pthread_mutex_unlock(&bg_conn->mutex);
 
     Rf_error("Failed to start a queue consumer. %s", errbuff);
   }
 
   con->tag = amqp_bytes_malloc_dup(consume_ok->consumer_tag);
+  init_consumer_spec(&con->spec, queue_str, has_no_ack, is_exclusive,
+                     prefetch_count, arg_table);
 
   /* Inhibit GC for the function and environment. This is because R does not
    * have a way of knowing we are storing them in a C struct. */
   R_PreserveObject(fun);
   R_PreserveObject(rho);
+  R_PreserveObject(loop);
+  R_PreserveObject(filter);
 
   SEXP ext = PROTECT(R_MakeExternalPtr(con, R_NilValue, R_NilValue));
   R_RegisterCFinalizerEx(ext, R_finalize_bg_consumer, (Rboolean) 1);
@@ -539,6 +849,7 @@ extern "C" SEXP R_amqp_consume_later(SEXP ptr, SEXP queue, SEXP fun, SEXP rho,
     elt->next = con;
     con->prev = elt;
   }
+  bg_conn->consumer_count++;
 
   pthread_mutex_unlock(&bg_conn->mutex);
   UNPROTECT(3);
@@ -555,3 +866,55 @@ extern "C" SEXP R_amqp_destroy_bg_consumer(SEXP ptr)
 
   return R_NilValue;
 }
+
+extern "C" int bg_consumer_set_handler(SEXP consumer,
+                                       longears_message_handler handler,
+                                       void *data,
+                                       longears_handler_finalizer finalizer)
+{
+  if (Rf_inherits(consumer, "amqp_bg_consumer")) {
+    consumer = VECTOR_ELT(consumer, 0);
+  }
+  if (TYPEOF(consumer) != EXTPTRSXP) {
+    return -1;
+  }
+  bg_consumer *con = (bg_consumer *) R_ExternalPtrAddr(consumer);
+  if (!con || !con->conn) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&con->conn->mutex);
+
+  if (con->handler_finalizer) {
+    con->handler_finalizer(con->handler_data);
+  }
+  con->handler = handler;
+  con->handler_data = data;
+  con->handler_finalizer = finalizer;
+
+  /* Hand over any messages held for a consumer without an R callback. */
+  int failed_acks = 0;
+  pending_env *node;
+  while (handler && !con->has_fun && con->head) {
+    node = con->head;
+    con->head = node->next;
+    handler(&node->env, data);
+    if (!con->no_ack &&
+        amqp_basic_ack(con->conn->conn->conn, con->chan.chan,
+                       node->env.delivery_tag, 0) != AMQP_STATUS_OK) {
+      failed_acks++;
+    }
+    amqp_destroy_envelope(&node->env);
+    free(node);
+  }
+  if (!con->head) {
+    con->tail = NULL;
+  }
+
+  pthread_mutex_unlock(&con->conn->mutex);
+
+  if (failed_acks) {
+    Rf_warning("Failed to acknowledge %d message(s).", failed_acks);
+  }
+  return 0;
+}
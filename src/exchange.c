@@ -11,8 +11,11 @@ SEXP R_amqp_declare_exchange(SEXP ptr, SEXP exchange, SEXP type, SEXP passive,
                              SEXP args)
 {
   connection *conn = (connection *) R_ExternalPtrAddr(ptr);
+  conn_lock(conn);
   char errbuff[200];
   if (ensure_valid_channel(conn, &conn->chan, errbuff, 200) < 0) {
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to find an open channel. %s", errbuff);
     return R_NilValue;
   }
@@ -32,17 +35,32 @@ SEXP R_amqp_declare_exchange(SEXP ptr, SEXP exchange, SEXP type, SEXP passive,
   if (exch_ok == NULL) {
     amqp_rpc_reply_t reply = amqp_get_rpc_reply(conn->conn);
     render_amqp_error(reply, conn, &conn->chan, errbuff, 200);
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to declare exchange. %s", errbuff);
   }
 
+  if (!is_passive) {
+    int flags = (is_durable ? TOPOLOGY_DURABLE : 0) |
+      (is_auto_delete ? TOPOLOGY_AUTO_DELETE : 0) |
+      (is_internal ? TOPOLOGY_INTERNAL : 0);
+    record_topology(conn, TOPOLOGY_EXCHANGE, exchange_str, type_str,
+                    amqp_empty_bytes, flags, arg_table);
+  }
+
+  conn_unlock(conn);
+  raise_warnings(conn);
   return R_NilValue;
 }
 
 SEXP R_amqp_delete_exchange(SEXP ptr, SEXP exchange, SEXP if_unused)
 {
   connection *conn = (connection *) R_ExternalPtrAddr(ptr);
+  conn_lock(conn);
   char errbuff[200];
   if (ensure_valid_channel(conn, &conn->chan, errbuff, 200) < 0) {
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to find an open channel. %s", errbuff);
     return R_NilValue;
   }
@@ -56,8 +74,15 @@ SEXP R_amqp_delete_exchange(SEXP ptr, SEXP exchange, SEXP if_unused)
   if (delete_ok == NULL) {
     amqp_rpc_reply_t reply = amqp_get_rpc_reply(conn->conn);
     render_amqp_error(reply, conn, &conn->chan, errbuff, 200);
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to delete exchange. %s", errbuff);
   }
 
+  forget_topology(conn, TOPOLOGY_EXCHANGE, exchange_str, amqp_empty_bytes,
+                  amqp_empty_bytes);
+
+  conn_unlock(conn);
+  raise_warnings(conn);
   return R_NilValue;
 }
@@ -0,0 +1,252 @@
+#include <stdlib.h> /* for malloc, free */
+#include <string.h> /* for memcmp, memcpy */
+
+#include <amqp.h>
+#include <amqp_framing.h>
+
+#include "longears.h"
+#include "connection.h"
+#include "utils.h"
+
+/* Filters let consumers discard messages based on their headers or routing key
+   before anything is handed to R. Since they are evaluated on background
+   threads, compiled filters hold copies of everything they need rather than
+   referring to R objects. */
+
+static amqp_bytes_t pool_charsxp_dup(amqp_pool_t *pool, SEXP in)
+{
+  amqp_bytes_t out;
+  out.len = XLENGTH(in);
+  out.bytes = amqp_pool_alloc(pool, out.len);
+  memcpy(out.bytes, CHAR(in), out.len);
+  return out;
+}
+
+static void compile_rule(SEXP values, filter_rule *rule, amqp_pool_t *pool)
+{
+  rule->count = Rf_length(values);
+  rule->strings = NULL;
+  rule->numbers = NULL;
+
+  switch (TYPEOF(values)) {
+  case STRSXP:
+    rule->type = STRSXP;
+    rule->strings = amqp_pool_alloc(pool, rule->count * sizeof(amqp_bytes_t));
+    for (int i = 0; i < rule->count; i++) {
+      rule->strings[i] = pool_charsxp_dup(pool, STRING_ELT(values, i));
+    }
+    break;
+  case LGLSXP:
+    rule->type = LGLSXP;
+    rule->numbers = amqp_pool_alloc(pool, rule->count * sizeof(double));
+    for (int i = 0; i < rule->count; i++) {
+      rule->numbers[i] = LOGICAL(values)[i];
+    }
+    break;
+  case INTSXP:
+    /* fallthrough */
+  case REALSXP:
+    rule->type = REALSXP;
+    rule->numbers = amqp_pool_alloc(pool, rule->count * sizeof(double));
+    for (int i = 0; i < rule->count; i++) {
+      rule->numbers[i] = TYPEOF(values) == INTSXP ? INTEGER(values)[i]
+                                                  : REAL(values)[i];
+    }
+    break;
+  default:
+    Rf_error("Filters cannot match a '%s'.", type2char(TYPEOF(values)));
+    break;
+  }
+}
+
+/* Shell-style matching, where '*' matches any run of characters and '?' any
+   single character. */
+static int glob_match(const amqp_bytes_t *pattern, const amqp_bytes_t *str)
+{
+  const char *p = (const char *) pattern->bytes;
+  const char *s = (const char *) str->bytes;
+  size_t pi = 0, si = 0, star = pattern->len, mark = 0;
+
+  while (si < str->len) {
+    if (pi < pattern->len && (p[pi] == '?' || p[pi] == s[si])) {
+      pi++;
+      si++;
+    } else if (pi < pattern->len && p[pi] == '*') {
+      /* Try matching nothing first, and backtrack if that fails. */
+      star = pi++;
+      mark = si;
+    } else if (star < pattern->len) {
+      pi = star + 1;
+      si = ++mark;
+    } else {
+      return 0;
+    }
+  }
+  while (pi < pattern->len && p[pi] == '*') {
+    pi++;
+  }
+  return pi == pattern->len;
+}
+
+static int value_matches(const filter_rule *rule,
+                         const amqp_field_value_t *value)
+{
+  double number;
+  switch (value->kind) {
+  case AMQP_FIELD_KIND_UTF8:
+    /* fallthrough */
+  case AMQP_FIELD_KIND_BYTES:
+    if (rule->type != STRSXP) return 0;
+    for (int i = 0; i < rule->count; i++) {
+      if (rule->strings[i].len == value->value.bytes.len &&
+          memcmp(rule->strings[i].bytes, value->value.bytes.bytes,
+                 value->value.bytes.len) == 0) {
+        return 1;
+      }
+    }
+    return 0;
+  case AMQP_FIELD_KIND_BOOLEAN:
+    if (rule->type != LGLSXP) return 0;
+    number = value->value.boolean ? 1 : 0;
+    break;
+  case AMQP_FIELD_KIND_I8:
+    number = value->value.i8;
+    break;
+  case AMQP_FIELD_KIND_U8:
+    number = value->value.u8;
+    break;
+  case AMQP_FIELD_KIND_I16:
+    number = value->value.i16;
+    break;
+  case AMQP_FIELD_KIND_U16:
+    number = value->value.u16;
+    break;
+  case AMQP_FIELD_KIND_I32:
+    number = value->value.i32;
+    break;
+  case AMQP_FIELD_KIND_U32:
+    number = value->value.u32;
+    break;
+  case AMQP_FIELD_KIND_I64:
+    number = (double) value->value.i64;
+    break;
+  case AMQP_FIELD_KIND_U64:
+    number = (double) value->value.u64;
+    break;
+  case AMQP_FIELD_KIND_F32:
+    number = value->value.f32;
+    break;
+  case AMQP_FIELD_KIND_F64:
+    number = value->value.f64;
+    break;
+  default:
+    return 0;
+  }
+
+  if (rule->type == STRSXP ||
+      (rule->type == LGLSXP && value->kind != AMQP_FIELD_KIND_BOOLEAN)) {
+    return 0;
+  }
+  for (int i = 0; i < rule->count; i++) {
+    if (rule->numbers[i] == number) return 1;
+  }
+  return 0;
+}
+
+static int rule_matches(const filter_rule *rule, const amqp_envelope_t *env)
+{
+  if (rule->routing_key) {
+    for (int i = 0; i < rule->count; i++) {
+      if (glob_match(&rule->strings[i], &env->routing_key)) return 1;
+    }
+    return 0;
+  }
+
+  const amqp_basic_properties_t *props = &env->message.properties;
+  if (!(props->_flags & AMQP_BASIC_HEADERS_FLAG)) {
+    return 0;
+  }
+  for (int i = 0; i < props->headers.num_entries; i++) {
+    const amqp_table_entry_t *entry = &props->headers.entries[i];
+    if (entry->key.len == rule->header.len &&
+        memcmp(entry->key.bytes, rule->header.bytes, entry->key.len) == 0) {
+      return value_matches(rule, &entry->value);
+    }
+  }
+  /* Missing headers never match. */
+  return 0;
+}
+
+int filter_matches(const message_filter *filter, const amqp_envelope_t *env)
+{
+  for (int i = 0; i < filter->rule_count; i++) {
+    if (!rule_matches(&filter->rules[i], env)) return 0;
+  }
+  return 1;
+}
+
+int discard_message(amqp_connection_state_t conn, amqp_channel_t chan,
+                    const message_filter *filter, uint64_t delivery_tag)
+{
+  if (filter->ack) {
+    return amqp_basic_ack(conn, chan, delivery_tag, 0);
+  }
+  return amqp_basic_nack(conn, chan, delivery_tag, 0, filter->requeue);
+}
+
+static void R_finalize_filter(SEXP ptr)
+{
+  message_filter *filter = (message_filter *) R_ExternalPtrAddr(ptr);
+  if (filter) {
+    empty_amqp_pool(&filter->pool);
+    free(filter);
+  }
+  R_ClearExternalPtr(ptr);
+}
+
+SEXP R_amqp_compile_filter(SEXP headers, SEXP routing_keys, SEXP ack,
+                           SEXP requeue)
+{
+  int header_count = Rf_length(headers);
+  int has_routing_keys = !Rf_isNull(routing_keys);
+
+  message_filter *filter = malloc(sizeof(message_filter));
+  init_amqp_pool(&filter->pool, 512);
+  filter->rule_count = 0;
+  filter->ack = asLogical(ack) == 1;
+  filter->requeue = asLogical(requeue) == 1;
+
+  /* Wrap the filter first, so that it is released if compilation fails. */
+  SEXP ptr = PROTECT(R_MakeExternalPtr(filter, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(ptr, R_finalize_filter, 1);
+
+  filter->rules = amqp_pool_alloc(
+    &filter->pool, (header_count + has_routing_keys) * sizeof(filter_rule)
+  );
+
+  SEXP names = Rf_getAttrib(headers, R_NamesSymbol);
+  filter_rule *rule;
+  for (int i = 0; i < header_count; i++) {
+    /* Rules only look at headers, so don't silently discard everything when
+       asked to match a basic property. */
+    if (property_flag(STRING_ELT(names, i)) != 0) {
+      Rf_error("Filters cannot match the '%s' property, only headers.",
+               CHAR(STRING_ELT(names, i)));
+    }
+    rule = &filter->rules[i];
+    rule->routing_key = 0;
+    rule->header = pool_charsxp_dup(&filter->pool, STRING_ELT(names, i));
+    compile_rule(VECTOR_ELT(headers, i), rule, &filter->pool);
+    filter->rule_count++;
+  }
+  if (has_routing_keys) {
+    rule = &filter->rules[header_count];
+    rule->routing_key = 1;
+    rule->header = amqp_empty_bytes;
+    compile_rule(routing_keys, rule, &filter->pool);
+    filter->rule_count++;
+  }
+
+  UNPROTECT(1);
+  return ptr;
+}
@@ -0,0 +1,125 @@
+#include <time.h> /* for nanosleep, time */
+
+#ifdef _WIN32
+#include <winsock2.h> /* for ioctlsocket, FIONREAD */
+#else
+#include <sys/ioctl.h> /* for ioctl, FIONREAD */
+#endif
+
+#include <amqp.h>
+#include <amqp_framing.h>
+
+#include "connection.h"
+
+/* librabbitmq only sends heartbeats as a side effect of other calls on the
+   connection, so a connection that is left idle while R is busy will
+   eventually be closed by the server. This optional thread sends them in the
+   meantime, whenever the main thread is not using the connection.
+
+   Heartbeats from the server are left in the socket buffer, where they will be
+   read (and checked) the next time the connection is used, since reading them
+   here would risk consuming messages intended for the main thread. Instead,
+   the server counts as alive whenever more data is waiting on the socket (or
+   the main thread has used the connection), and the connection is marked as
+   closed if neither happens for two heartbeat intervals, as librabbitmq itself
+   would when reading. */
+
+/* The number of bytes waiting to be read from the socket, or -1 on failure. */
+static long readable_bytes(amqp_connection_state_t conn)
+{
+  int fd = amqp_get_sockfd(conn);
+  if (fd < 0) return -1;
+#ifdef _WIN32
+  u_long count = 0;
+  if (ioctlsocket(fd, FIONREAD, &count) != 0) return -1;
+#else
+  int count = 0;
+  if (ioctl(fd, FIONREAD, &count) != 0) return -1;
+#endif
+  return (long) count;
+}
+
+static void * heartbeat_run(void *data)
+{
+  connection *conn = (connection *) data;
+  time_t last_sent = time(NULL), last_heard = last_sent;
+  unsigned long lock_count = 0;
+  long readable = -1, now_readable;
+  int heartbeat, interval;
+
+  struct timespec sleeptime;
+  sleeptime.tv_sec = 1;
+  sleeptime.tv_nsec = 0;
+
+  amqp_frame_t frame;
+  frame.frame_type = AMQP_FRAME_HEARTBEAT;
+  frame.channel = 0;
+
+  for (;;) {
+    nanosleep(&sleeptime, NULL);
+
+    /* Supress thread cancellation while we might hold the mutex. */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    /* Don't wait for the main thread, since it has the connection in hand. */
+    if (pthread_mutex_trylock(&conn->mutex) != 0) {
+      last_heard = time(NULL);
+    } else {
+      heartbeat = conn->is_connected && conn->conn ?
+        amqp_get_heartbeat(conn->conn) : 0;
+      if (heartbeat > 0) {
+        now_readable = readable_bytes(conn->conn);
+        if (conn->lock_count != lock_count || now_readable != readable) {
+          last_heard = time(NULL);
+        }
+        lock_count = conn->lock_count;
+        readable = now_readable;
+
+        /* Send at twice the negotiated rate, as the specification suggests. */
+        interval = heartbeat / 2 > 0 ? heartbeat / 2 : 1;
+        if (time(NULL) - last_heard > 2 * heartbeat) {
+          /* The main thread will reconnect (or report the error) the next
+             time the connection is used. */
+          conn->is_connected = 0;
+          conn->chan.is_open = 0;
+        } else if (time(NULL) - last_sent >= interval) {
+          /* Failures will surface on the main thread the next time the
+             connection is used. */
+          amqp_send_frame(conn->conn, &frame);
+          last_sent = time(NULL);
+        }
+      } else {
+        /* Start afresh if the connection is reopened. */
+        last_heard = time(NULL);
+        readable = -1;
+      }
+      pthread_mutex_unlock(&conn->mutex);
+    }
+
+    /* Allow the thread to be cancelled here. */
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    pthread_testcancel();
+  }
+
+  return NULL;
+}
+
+int start_heartbeat(connection *conn)
+{
+  if (conn->has_heartbeat) return 0;
+  int res = pthread_create(&conn->heartbeat, NULL, heartbeat_run, conn);
+  if (res == 0) {
+    conn->has_heartbeat = 1;
+  }
+  return res;
+}
+
+void stop_heartbeat(connection *conn)
+{
+  if (!conn->has_heartbeat) return;
+  if (pthread_cancel(conn->heartbeat) == 0) {
+    /* No point in checking the result. */
+    pthread_join(conn->heartbeat, NULL);
+  }
+  conn->has_heartbeat = 0;
+}
@@ -0,0 +1,182 @@
+#include <cstdlib> /* for malloc, free */
+
+#ifdef _WIN32
+#include <winsock2.h> /* for struct pollfd */
+#else
+#include <poll.h> /* for struct pollfd */
+#endif
+
+#include <amqp.h>
+#include <amqp_framing.h>
+
+#include <later_api.h>
+
+#include "longears.h"
+#include "connection.h"
+
+/* This implements consumption on the main thread, driven by the event loop
+   instead of blocking in amqp_listen(). We ask later to watch the socket and
+   only read from it when it becomes readable.
+
+   The connection object is preserved for as long as there are callbacks
+   waiting to run, since they refer to it. */
+
+/* How long to wait for the socket to become readable before checking in. */
+#define LISTEN_LATER_TIMEOUT 60
+
+static void listen_fd_callback(int *ready, void *data);
+static void listen_now_callback(void *data);
+
+static void stop_listening(SEXP ptr, connection *conn)
+{
+  conn->listening = 0;
+  if (conn->pending_callbacks == 0) {
+    R_ReleaseObject(ptr);
+  }
+}
+
+static void schedule_fd_callback(SEXP ptr, connection *conn)
+{
+  struct pollfd fd;
+  fd.fd = amqp_get_sockfd(conn->conn);
+  fd.events = POLLIN;
+  fd.revents = 0;
+  conn->pending_callbacks++;
+  later::later_fd(listen_fd_callback, (void *) ptr, 1, &fd,
+                  LISTEN_LATER_TIMEOUT, conn->loop_id);
+}
+
+static void listen_on_loop(SEXP ptr)
+{
+  connection *conn = (connection *) R_ExternalPtrAddr(ptr);
+  if (!conn) {
+    /* The connection has been destroyed. */
+    R_ReleaseObject(ptr);
+    return;
+  }
+  conn->pending_callbacks--;
+  if (!conn->listening) {
+    if (conn->pending_callbacks == 0) {
+      R_ReleaseObject(ptr);
+    }
+    return;
+  }
+  if (!conn->is_connected || !conn->conn) {
+    stop_listening(ptr, conn);
+    Rf_warning("Disconnected from server. Stopped listening for messages.");
+    return;
+  }
+
+  /* Re-arm the watcher up front, in case a callback fails. */
+  if (conn->pending_callbacks == 0) {
+    schedule_fd_callback(ptr, conn);
+  }
+
+  /* Handle any messages that are ready without blocking, including those that
+     have already been read from the socket. Note that the zero timeout only
+     applies to a message's first frame: amqp_consume_message() then blocks
+     until the header and body frames have arrived, and librabbitmq offers no
+     way to bound that wait or resume a partially-read message. */
+  struct timeval tv;
+  tv.tv_sec = 0;
+  tv.tv_usec = 0;
+  char errbuff[200];
+  int res;
+
+  for (int i = 0; i < conn->max_per_tick; i++) {
+    conn_lock(conn);
+    res = consume_message(conn, &tv, errbuff, 200);
+    conn_unlock(conn);
+    raise_warnings(conn);
+    if (res < 0) {
+      stop_listening(ptr, conn);
+      Rf_warning("%s Stopped listening for messages.", errbuff);
+      return;
+    }
+    if (!conn->listening) {
+      /* A callback has stopped listening for us. */
+      return;
+    }
+    if (!conn->is_connected || !conn->conn) {
+      /* A callback has disconnected for us. */
+      stop_listening(ptr, conn);
+      return;
+    }
+    if (res == 0 && !amqp_frames_enqueued(conn->conn) &&
+        !amqp_data_in_buffer(conn->conn)) {
+      return;
+    }
+  }
+
+  /* Buffered frames won't make the socket readable, so if we're yielding to
+     the loop with some left over, make sure we'll come back for them. */
+  if (amqp_frames_enqueued(conn->conn) || amqp_data_in_buffer(conn->conn)) {
+    conn->pending_callbacks++;
+    later::later(listen_now_callback, (void *) ptr, 0, conn->loop_id);
+  }
+}
+
+static void listen_fd_callback(int *ready, void *data)
+{
+  listen_on_loop((SEXP) data);
+}
+
+static void listen_now_callback(void *data)
+{
+  listen_on_loop((SEXP) data);
+}
+
+extern "C" SEXP R_amqp_listen_later(SEXP ptr, SEXP loop, SEXP max_per_tick)
+{
+  connection *conn = (connection *) R_ExternalPtrAddr(ptr);
+  if (!conn) {
+    Rf_error("The amqp connection no longer exists.");
+  }
+  int max_messages = Rf_asInteger(max_per_tick);
+  if (max_messages == NA_INTEGER || max_messages < 1) {
+    Rf_error("The maximum number of messages per tick must be positive.");
+  }
+  char errbuff[200];
+  conn_lock(conn);
+  int res = ensure_valid_channel(conn, &conn->chan, errbuff, 200);
+  conn_unlock(conn);
+  raise_warnings(conn);
+  if (res < 0) {
+    Rf_error("Failed to consume messages. %s", errbuff);
+  }
+  int loop_id = Rf_asInteger(Rf_findVarInFrame(loop, Rf_install("id")));
+  if (conn->listening) {
+    if (loop_id != conn->loop_id) {
+      Rf_error("Already listening for messages on another event loop.");
+    }
+    conn->max_per_tick = max_messages;
+    return R_NilValue;
+  }
+
+  /* Keep the connection alive while callbacks are pending. */
+  if (conn->pending_callbacks == 0) {
+    R_PreserveObject(ptr);
+  }
+  conn->listening = 1;
+  conn->loop_id = loop_id;
+  conn->max_per_tick = max_messages;
+
+  /* Start with a regular callback to pick up any messages that have already
+     been read from the socket. */
+  conn->pending_callbacks++;
+  later::later(listen_now_callback, (void *) ptr, 0, conn->loop_id);
+
+  return R_NilValue;
+}
+
+extern "C" SEXP R_amqp_stop_listening(SEXP ptr)
+{
+  connection *conn = (connection *) R_ExternalPtrAddr(ptr);
+  if (!conn) {
+    Rf_error("The amqp connection no longer exists.");
+  }
+  if (conn->listening) {
+    stop_listening(ptr, conn);
+  }
+  return R_NilValue;
+}
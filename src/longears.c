@@ -1,13 +1,19 @@
 #include "longears.h"
+#include "connection.h"
 #include "constants.h"
 
 static const R_CallMethodDef longears_entries[] = {
-  {"R_amqp_connect", (DL_FUNC) &R_amqp_connect, 7},
+  {"R_amqp_connect", (DL_FUNC) &R_amqp_connect, 20},
   {"R_amqp_is_connected", (DL_FUNC) &R_amqp_is_connected, 1},
+  {"R_amqp_tune_params", (DL_FUNC) &R_amqp_tune_params, 1},
+  {"R_amqp_current_endpoint", (DL_FUNC) &R_amqp_current_endpoint, 1},
   {"R_amqp_client_properties", (DL_FUNC) &R_amqp_client_properties, 1},
   {"R_amqp_server_properties", (DL_FUNC) &R_amqp_server_properties, 1},
   {"R_amqp_reconnect", (DL_FUNC) &R_amqp_reconnect, 1},
+  {"R_amqp_connect_later", (DL_FUNC) &R_amqp_connect_later, 3},
   {"R_amqp_disconnect", (DL_FUNC) &R_amqp_disconnect, 1},
+  {"R_amqp_is_blocked", (DL_FUNC) &R_amqp_is_blocked, 1},
+  {"R_amqp_blocked_stats", (DL_FUNC) &R_amqp_blocked_stats, 1},
   {"R_amqp_declare_exchange", (DL_FUNC) &R_amqp_declare_exchange, 8},
   {"R_amqp_delete_exchange", (DL_FUNC) &R_amqp_delete_exchange, 3},
   {"R_amqp_declare_queue", (DL_FUNC) &R_amqp_declare_queue, 7},
@@ -17,23 +23,48 @@ static const R_CallMethodDef longears_entries[] = {
   {"R_amqp_bind_exchange", (DL_FUNC) &R_amqp_bind_exchange, 5},
   {"R_amqp_unbind_exchange", (DL_FUNC) &R_amqp_unbind_exchange, 5},
   {"R_amqp_publish", (DL_FUNC) &R_amqp_publish, 7},
-  {"R_amqp_get", (DL_FUNC) &R_amqp_get, 3},
+  {"R_amqp_publish_batch", (DL_FUNC) &R_amqp_publish_batch, 8},
+  {"R_amqp_publish_file", (DL_FUNC) &R_amqp_publish_file, 7},
+  {"R_amqp_get", (DL_FUNC) &R_amqp_get, 5},
   {"R_amqp_ack_on_channel", (DL_FUNC) &R_amqp_ack_on_channel, 4},
   {"R_amqp_nack_on_channel", (DL_FUNC) &R_amqp_nack_on_channel, 5},
-  {"R_amqp_create_consumer", (DL_FUNC) &R_amqp_create_consumer, 9},
+  {"R_amqp_reject_on_channel", (DL_FUNC) &R_amqp_reject_on_channel, 4},
+  {"R_amqp_create_consumer", (DL_FUNC) &R_amqp_create_consumer, 10},
   {"R_amqp_listen", (DL_FUNC) &R_amqp_listen, 2},
-  {"R_amqp_consume_later", (DL_FUNC) &R_amqp_consume_later, 9},
+  {"R_amqp_listen_all", (DL_FUNC) &R_amqp_listen_all, 2},
+  {"R_amqp_listen_later", (DL_FUNC) &R_amqp_listen_later, 3},
+  {"R_amqp_stop_listening", (DL_FUNC) &R_amqp_stop_listening, 1},
+  {"R_amqp_consume_later", (DL_FUNC) &R_amqp_consume_later, 13},
+  {"R_amqp_compile_filter", (DL_FUNC) &R_amqp_compile_filter, 4},
+  {"R_amqp_compile_topics", (DL_FUNC) &R_amqp_compile_topics, 1},
+  {"R_amqp_match_topic", (DL_FUNC) &R_amqp_match_topic, 2},
   {"R_amqp_destroy_consumer", (DL_FUNC) &R_amqp_destroy_consumer, 1},
   {"R_amqp_destroy_bg_consumer", (DL_FUNC) &R_amqp_destroy_bg_consumer, 1},
   {"R_amqp_encode_properties", (DL_FUNC) &R_amqp_encode_properties, 1},
   {"R_amqp_decode_properties", (DL_FUNC) &R_amqp_decode_properties, 1},
   {"R_amqp_encode_table", (DL_FUNC) &R_amqp_encode_table, 1},
   {"R_amqp_decode_table", (DL_FUNC) &R_amqp_decode_table, 1},
+  {"R_amqp_messages_to_df", (DL_FUNC) &R_amqp_messages_to_df, 1},
+  {"R_amqp_msgpack_encode", (DL_FUNC) &R_amqp_msgpack_encode, 1},
+  {"R_amqp_msgpack_decode", (DL_FUNC) &R_amqp_msgpack_decode, 2},
   {NULL, NULL, 0}
 };
 
 void R_init_longears(DllInfo *info) {
   R_registerRoutines(info, NULL, longears_entries, NULL, NULL);
   R_useDynamicSymbols(info, FALSE);
+  R_RegisterCCallable("longears", "longears_get_connection",
+                      (DL_FUNC) &api_get_connection);
+  R_RegisterCCallable("longears", "longears_ensure_channel",
+                      (DL_FUNC) &api_ensure_channel);
+  R_RegisterCCallable("longears", "longears_publish", (DL_FUNC) &api_publish);
+  R_RegisterCCallable("longears", "longears_get", (DL_FUNC) &api_get);
+  R_RegisterCCallable("longears", "longears_ack", (DL_FUNC) &api_ack);
+  R_RegisterCCallable("longears", "longears_nack", (DL_FUNC) &api_nack);
+  R_RegisterCCallable("longears", "longears_consume", (DL_FUNC) &api_consume);
+  R_RegisterCCallable("longears", "longears_consume_message",
+                      (DL_FUNC) &api_consume_message);
+  R_RegisterCCallable("longears", "longears_set_native_handler",
+                      (DL_FUNC) &bg_consumer_set_handler);
   init_static_sexps();
 }
@@ -14,12 +14,17 @@
 extern "C" {
 #endif
 
-SEXP R_amqp_connect(SEXP host, SEXP port, SEXP vhost, SEXP username, SEXP password, SEXP timeout, SEXP name);
+SEXP R_amqp_connect(SEXP host, SEXP port, SEXP vhost, SEXP username, SEXP password, SEXP timeout, SEXP name, SEXP bg_threads, SEXP heartbeat_thread, SEXP recover, SEXP recover_attempts, SEXP recover_backoff, SEXP channel_max, SEXP frame_max, SEXP heartbeat, SEXP tcp_nodelay, SEXP sndbuf, SEXP rcvbuf, SEXP tls, SEXP lazy);
 SEXP R_amqp_is_connected(SEXP ptr);
+SEXP R_amqp_tune_params(SEXP ptr);
+SEXP R_amqp_current_endpoint(SEXP ptr);
 SEXP R_amqp_client_properties(SEXP ptr);
 SEXP R_amqp_server_properties(SEXP ptr);
 SEXP R_amqp_reconnect(SEXP ptr);
+SEXP R_amqp_connect_later(SEXP ptr, SEXP done, SEXP loop);
 SEXP R_amqp_disconnect(SEXP ptr);
+SEXP R_amqp_is_blocked(SEXP ptr);
+SEXP R_amqp_blocked_stats(SEXP ptr);
 
 SEXP R_amqp_declare_exchange(SEXP ptr, SEXP exchange, SEXP type, SEXP passive, SEXP durable, SEXP auto_delete, SEXP internal, SEXP args);
 SEXP R_amqp_delete_exchange(SEXP ptr, SEXP exchange, SEXP if_unused);
@@ -33,13 +38,25 @@ SEXP R_amqp_bind_exchange(SEXP ptr, SEXP dest, SEXP source, SEXP routing_key, SE
 SEXP R_amqp_unbind_exchange(SEXP ptr, SEXP dest, SEXP source, SEXP routing_key, SEXP args);
 
 SEXP R_amqp_publish(SEXP ptr, SEXP routing_key, SEXP body, SEXP exchange, SEXP context_type, SEXP mandatory, SEXP immediate);
-SEXP R_amqp_get(SEXP ptr, SEXP queue, SEXP no_ack);
+SEXP R_amqp_publish_batch(SEXP ptr, SEXP bodies, SEXP exchange, SEXP routing_key, SEXP mandatory, SEXP immediate, SEXP props, SEXP overrides);
+SEXP R_amqp_publish_file(SEXP ptr, SEXP path, SEXP exchange, SEXP routing_key, SEXP mandatory, SEXP immediate, SEXP props);
+SEXP R_amqp_get(SEXP ptr, SEXP queue, SEXP no_ack, SEXP file, SEXP ack);
 SEXP R_amqp_ack_on_channel(SEXP ptr, SEXP chan_ptr, SEXP delivery_tag, SEXP multiple);
 SEXP R_amqp_nack_on_channel(SEXP ptr, SEXP chan_ptr, SEXP delivery_tag, SEXP multiple, SEXP requeue);
+SEXP R_amqp_reject_on_channel(SEXP ptr, SEXP chan_ptr, SEXP delivery_tag, SEXP requeue);
 
-SEXP R_amqp_create_consumer(SEXP ptr, SEXP queue, SEXP tag, SEXP fun, SEXP rho, SEXP no_ack, SEXP exclusive, SEXP prefetch_count_, SEXP args);
+SEXP R_amqp_create_consumer(SEXP ptr, SEXP queue, SEXP tag, SEXP fun, SEXP rho, SEXP no_ack, SEXP exclusive, SEXP prefetch_count_, SEXP args, SEXP filter);
 SEXP R_amqp_listen(SEXP ptr, SEXP timeout);
-SEXP R_amqp_consume_later(SEXP ptr, SEXP queue, SEXP fun, SEXP rho, SEXP no_local, SEXP no_ack, SEXP exclusive, SEXP prefetch_count_, SEXP args);
+SEXP R_amqp_listen_all(SEXP ptrs, SEXP timeout);
+SEXP R_amqp_listen_later(SEXP ptr, SEXP loop, SEXP max_per_tick);
+SEXP R_amqp_stop_listening(SEXP ptr);
+SEXP R_amqp_consume_later(SEXP ptr, SEXP queue, SEXP fun, SEXP rho, SEXP no_local, SEXP no_ack, SEXP exclusive, SEXP prefetch_count_, SEXP args, SEXP thread, SEXP loop, SEXP max_per_tick, SEXP filter);
+SEXP R_amqp_compile_filter(SEXP headers, SEXP routing_keys, SEXP ack, SEXP requeue);
+SEXP R_amqp_compile_topics(SEXP patterns);
+SEXP R_amqp_match_topic(SEXP ptr, SEXP routing_keys);
+SEXP R_amqp_messages_to_df(SEXP messages);
+SEXP R_amqp_msgpack_encode(SEXP x);
+SEXP R_amqp_msgpack_decode(SEXP body, SEXP simplify);
 SEXP R_amqp_destroy_consumer(SEXP ptr);
 SEXP R_amqp_destroy_bg_consumer(SEXP ptr);
 
@@ -0,0 +1,231 @@
+#include <string.h> /* for memcpy */
+
+#include "longears.h"
+#include "constants.h"
+
+/* Converting a list of messages into a data frame column by column, rather
+   than binding together one-row data frames for each of them. Message fields
+   and properties present in only some of the messages are filled with NA. */
+
+typedef struct df_column {
+  SEXP name;
+  /* The first value seen, which determines the column's type. */
+  SEXP first;
+  /* Whether every value is a length-one vector of the same type. */
+  int atomic;
+  SEXP values;
+} df_column;
+
+typedef struct df_columns {
+  df_column *cols;
+  int count;
+  int capacity;
+  /* Where the next lookup should start. */
+  int hint;
+} df_columns;
+
+static void init_columns(df_columns *columns)
+{
+  columns->capacity = 16;
+  columns->cols = (df_column *) R_alloc(columns->capacity, sizeof(df_column));
+  columns->count = 0;
+  columns->hint = 0;
+}
+
+static df_column *find_column(df_columns *columns, SEXP name, int create)
+{
+  /* Messages almost always have their fields in the same order, so start
+     looking after the column found last time. */
+  for (int k = 0; k < columns->count; k++) {
+    int j = (columns->hint + k) % columns->count;
+    if (columns->cols[j].name == name) {
+      columns->hint = j + 1;
+      return &columns->cols[j];
+    }
+  }
+  if (!create) return NULL;
+
+  if (columns->count == columns->capacity) {
+    df_column *cols = (df_column *) R_alloc(2 * columns->capacity,
+                                            sizeof(df_column));
+    memcpy(cols, columns->cols, columns->count * sizeof(df_column));
+    columns->cols = cols;
+    columns->capacity *= 2;
+  }
+  df_column *col = &columns->cols[columns->count++];
+  col->name = name;
+  col->first = R_NilValue;
+  col->atomic = 1;
+  col->values = R_NilValue;
+  columns->hint = columns->count;
+  return col;
+}
+
+static int is_scalar(SEXP value)
+{
+  switch (TYPEOF(value)) {
+  case LGLSXP:
+  case INTSXP:
+  case REALSXP:
+  case STRSXP:
+    return XLENGTH(value) == 1;
+  default:
+    return 0;
+  }
+}
+
+static void observe_value(df_column *col, SEXP value)
+{
+  if (value == R_NilValue) return;
+  if (col->first == R_NilValue) {
+    col->first = value;
+    col->atomic = is_scalar(value);
+  } else if (col->atomic &&
+             (!is_scalar(value) || TYPEOF(value) != TYPEOF(col->first))) {
+    col->atomic = 0;
+  }
+}
+
+static void observe_list(df_columns *columns, SEXP list)
+{
+  SEXP names = Rf_getAttrib(list, R_NamesSymbol);
+  for (int j = 0; j < Rf_length(list); j++) {
+    df_column *col = find_column(columns, STRING_ELT(names, j), 1);
+    observe_value(col, VECTOR_ELT(list, j));
+  }
+}
+
+static SEXP alloc_column(df_column *col, R_xlen_t n)
+{
+  if (!col->atomic || col->first == R_NilValue) {
+    col->atomic = 0;
+    col->values = Rf_allocVector(VECSXP, n);
+    return col->values;
+  }
+
+  SEXPTYPE type = TYPEOF(col->first);
+  col->values = PROTECT(Rf_allocVector(type, n));
+  for (R_xlen_t i = 0; i < n; i++) {
+    switch (type) {
+    case LGLSXP:
+      LOGICAL(col->values)[i] = NA_LOGICAL;
+      break;
+    case INTSXP:
+      INTEGER(col->values)[i] = NA_INTEGER;
+      break;
+    case REALSXP:
+      REAL(col->values)[i] = NA_REAL;
+      break;
+    default:
+      SET_STRING_ELT(col->values, i, NA_STRING);
+      break;
+    }
+  }
+  /* Keep classes like POSIXct. */
+  Rf_copyMostAttrib(col->first, col->values);
+  UNPROTECT(1);
+  return col->values;
+}
+
+static void fill_list(df_columns *columns, SEXP list, R_xlen_t i)
+{
+  SEXP names = Rf_getAttrib(list, R_NamesSymbol);
+  for (int j = 0; j < Rf_length(list); j++) {
+    df_column *col = find_column(columns, STRING_ELT(names, j), 0);
+    SEXP value = VECTOR_ELT(list, j);
+    /* Skips the body and properties, when filling in message fields. */
+    if (!col || value == R_NilValue) continue;
+    if (!col->atomic) {
+      SET_VECTOR_ELT(col->values, i, value);
+      continue;
+    }
+    switch (TYPEOF(value)) {
+    case LGLSXP:
+      LOGICAL(col->values)[i] = LOGICAL(value)[0];
+      break;
+    case INTSXP:
+      INTEGER(col->values)[i] = INTEGER(value)[0];
+      break;
+    case REALSXP:
+      REAL(col->values)[i] = REAL(value)[0];
+      break;
+    default:
+      SET_STRING_ELT(col->values, i, STRING_ELT(value, 0));
+      break;
+    }
+  }
+}
+
+SEXP R_amqp_messages_to_df(SEXP messages)
+{
+  R_xlen_t n = XLENGTH(messages);
+  /* Both kinds of message share these names. */
+  SEXP body_name = STRING_ELT(message_names_get, 0);
+  SEXP properties_name = STRING_ELT(message_names_get, 6);
+
+  /* First, determine the columns and their types. */
+  df_columns fields, props;
+  init_columns(&fields);
+  init_columns(&props);
+  for (R_xlen_t i = 0; i < n; i++) {
+    SEXP msg = VECTOR_ELT(messages, i);
+    if (TYPEOF(msg) != VECSXP || !Rf_inherits(msg, "amqp_message")) {
+      Rf_error("Element %lld is not an amqp_message object.",
+               (long long) i + 1);
+    }
+    SEXP names = Rf_getAttrib(msg, R_NamesSymbol);
+    for (int j = 0; j < Rf_length(msg); j++) {
+      SEXP name = STRING_ELT(names, j);
+      if (name == body_name) {
+        continue;
+      } else if (name == properties_name) {
+        observe_list(&props, VECTOR_ELT(msg, j));
+      } else {
+        observe_value(find_column(&fields, name, 1), VECTOR_ELT(msg, j));
+      }
+    }
+  }
+
+  /* Columns are ordered as in as.data.frame(): fields, properties, body. */
+  int ncols = fields.count + props.count + 1;
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, ncols));
+  SEXP out_names = PROTECT(Rf_allocVector(STRSXP, ncols));
+  int k = 0;
+  for (int j = 0; j < fields.count; j++, k++) {
+    SET_VECTOR_ELT(out, k, alloc_column(&fields.cols[j], n));
+    SET_STRING_ELT(out_names, k, fields.cols[j].name);
+  }
+  for (int j = 0; j < props.count; j++, k++) {
+    SET_VECTOR_ELT(out, k, alloc_column(&props.cols[j], n));
+    SET_STRING_ELT(out_names, k, props.cols[j].name);
+  }
+  SEXP bodies = Rf_allocVector(VECSXP, n);
+  SET_VECTOR_ELT(out, k, bodies);
+  SET_STRING_ELT(out_names, k, body_name);
+
+  /* Then fill them in. */
+  for (R_xlen_t i = 0; i < n; i++) {
+    SEXP msg = VECTOR_ELT(messages, i);
+    SEXP names = Rf_getAttrib(msg, R_NamesSymbol);
+    for (int j = 0; j < Rf_length(msg); j++) {
+      SEXP name = STRING_ELT(names, j);
+      if (name == body_name) {
+        SET_VECTOR_ELT(bodies, i, VECTOR_ELT(msg, j));
+      } else if (name == properties_name) {
+        fill_list(&props, VECTOR_ELT(msg, j), i);
+      }
+    }
+    fill_list(&fields, msg, i);
+  }
+
+  Rf_setAttrib(out, R_NamesSymbol, out_names);
+  /* Compact row names, i.e. c(NA, -n). */
+  SEXP row_names = PROTECT(Rf_allocVector(INTSXP, 2));
+  INTEGER(row_names)[0] = NA_INTEGER;
+  INTEGER(row_names)[1] = -n;
+  Rf_setAttrib(out, R_RowNamesSymbol, row_names);
+  Rf_setAttrib(out, R_ClassSymbol, tbl_df_class);
+
+  UNPROTECT(3);
+  return out;
+}
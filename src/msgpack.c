@@ -0,0 +1,526 @@
+#include <stdint.h> /* for uint8_t, int64_t */
+#include <string.h> /* for memcpy, strlen */
+
+#include "longears.h"
+
+/* A MessagePack codec for message bodies, so that structured records can be
+   exchanged with non-R services without a round-trip through R code.
+
+   Encoding happens in two passes over the object: the first computes the size
+   of the output (and rejects anything we cannot encode), and the second writes
+   directly into a raw vector of exactly that size. */
+
+/* Guard against stack exhaustion on deeply nested input. */
+#define MSGPACK_MAX_DEPTH 512
+
+typedef struct msgpack_writer {
+  uint8_t *out;
+  size_t pos;
+} msgpack_writer;
+
+static void write_byte(msgpack_writer *w, uint8_t byte)
+{
+  if (w->out) w->out[w->pos] = byte;
+  w->pos++;
+}
+
+static void write_be(msgpack_writer *w, uint64_t value, int width)
+{
+  if (w->out) {
+    for (int i = 0; i < width; i++) {
+      w->out[w->pos + i] = (uint8_t) (value >> (8 * (width - i - 1)));
+    }
+  }
+  w->pos += width;
+}
+
+static void write_bytes(msgpack_writer *w, const void *bytes, size_t len)
+{
+  if (w->out && len > 0) memcpy(w->out + w->pos, bytes, len);
+  w->pos += len;
+}
+
+static void write_int(msgpack_writer *w, int64_t value)
+{
+  if (value >= 0) {
+    if (value < 128) {
+      write_byte(w, (uint8_t) value);
+    } else if (value <= UINT8_MAX) {
+      write_byte(w, 0xcc);
+      write_be(w, value, 1);
+    } else if (value <= UINT16_MAX) {
+      write_byte(w, 0xcd);
+      write_be(w, value, 2);
+    } else if (value <= UINT32_MAX) {
+      write_byte(w, 0xce);
+      write_be(w, value, 4);
+    } else {
+      write_byte(w, 0xcf);
+      write_be(w, value, 8);
+    }
+  } else if (value >= -32) {
+    write_byte(w, (uint8_t) (value & 0xff));
+  } else if (value >= INT8_MIN) {
+    write_byte(w, 0xd0);
+    write_be(w, (uint64_t) value, 1);
+  } else if (value >= INT16_MIN) {
+    write_byte(w, 0xd1);
+    write_be(w, (uint64_t) value, 2);
+  } else if (value >= INT32_MIN) {
+    write_byte(w, 0xd2);
+    write_be(w, (uint64_t) value, 4);
+  } else {
+    write_byte(w, 0xd3);
+    write_be(w, (uint64_t) value, 8);
+  }
+}
+
+static void write_double(msgpack_writer *w, double value)
+{
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  write_byte(w, 0xcb);
+  write_be(w, bits, 8);
+}
+
+/* Strings, binary data, arrays and maps all have a header giving their length,
+   in the smallest of the available forms. A zero first8 or fix_max means that
+   there is no 8-bit or "fix" form, respectively. */
+static void write_header(msgpack_writer *w, size_t len, uint8_t fix,
+                         size_t fix_max, uint8_t first8, uint8_t first16,
+                         uint8_t first32)
+{
+  if (len < fix_max) {
+    write_byte(w, fix | (uint8_t) len);
+  } else if (first8 && len <= UINT8_MAX) {
+    write_byte(w, first8);
+    write_be(w, len, 1);
+  } else if (len <= UINT16_MAX) {
+    write_byte(w, first16);
+    write_be(w, len, 2);
+  } else if (len <= UINT32_MAX) {
+    write_byte(w, first32);
+    write_be(w, len, 4);
+  } else {
+    Rf_error("Cannot encode more than 2^32 - 1 elements or bytes.");
+  }
+}
+
+static void write_str(msgpack_writer *w, SEXP str)
+{
+  if (str == NA_STRING) {
+    write_byte(w, 0xc0);
+    return;
+  }
+  const char *bytes = Rf_translateCharUTF8(str);
+  size_t len = strlen(bytes);
+  write_header(w, len, 0xa0, 32, 0xd9, 0xda, 0xdb);
+  write_bytes(w, bytes, len);
+}
+
+static void write_array_header(msgpack_writer *w, size_t len)
+{
+  write_header(w, len, 0x90, 16, 0, 0xdc, 0xdd);
+}
+
+static void write_map_header(msgpack_writer *w, size_t len)
+{
+  write_header(w, len, 0x80, 16, 0, 0xde, 0xdf);
+}
+
+/* Write the i-th element of an atomic vector as a scalar. */
+static void write_element(msgpack_writer *w, SEXP x, R_xlen_t i)
+{
+  switch (TYPEOF(x)) {
+  case LGLSXP:
+    if (LOGICAL(x)[i] == NA_LOGICAL) {
+      write_byte(w, 0xc0);
+    } else {
+      write_byte(w, LOGICAL(x)[i] ? 0xc3 : 0xc2);
+    }
+    break;
+  case INTSXP:
+    if (INTEGER(x)[i] == NA_INTEGER) {
+      write_byte(w, 0xc0);
+    } else if (Rf_isFactor(x)) {
+      SEXP levels = Rf_getAttrib(x, R_LevelsSymbol);
+      write_str(w, STRING_ELT(levels, INTEGER(x)[i] - 1));
+    } else {
+      write_int(w, INTEGER(x)[i]);
+    }
+    break;
+  case REALSXP:
+    if (R_IsNA(REAL(x)[i])) {
+      write_byte(w, 0xc0);
+    } else {
+      write_double(w, REAL(x)[i]);
+    }
+    break;
+  case STRSXP:
+    write_str(w, STRING_ELT(x, i));
+    break;
+  default:
+    Rf_error("Cannot encode a '%s' vector as MessagePack.",
+             Rf_type2char(TYPEOF(x)));
+  }
+}
+
+static void write_object(msgpack_writer *w, SEXP x, int depth);
+
+static void write_data_frame(msgpack_writer *w, SEXP x, int depth)
+{
+  /* Data frames are encoded as an array of records, one per row. */
+  SEXP names = Rf_getAttrib(x, R_NamesSymbol);
+  int ncols = Rf_length(x);
+  R_xlen_t nrows = ncols > 0 ? Rf_xlength(VECTOR_ELT(x, 0)) : 0;
+  write_array_header(w, nrows);
+  for (R_xlen_t i = 0; i < nrows; i++) {
+    write_map_header(w, ncols);
+    for (int j = 0; j < ncols; j++) {
+      SEXP col = VECTOR_ELT(x, j);
+      write_str(w, STRING_ELT(names, j));
+      if (TYPEOF(col) == VECSXP) {
+        write_object(w, VECTOR_ELT(col, i), depth + 1);
+      } else {
+        write_element(w, col, i);
+      }
+    }
+  }
+}
+
+static void write_object(msgpack_writer *w, SEXP x, int depth)
+{
+  if (depth > MSGPACK_MAX_DEPTH) {
+    Rf_error("Cannot encode objects nested more than %d levels deep.",
+             MSGPACK_MAX_DEPTH);
+  }
+
+  R_xlen_t len = Rf_xlength(x);
+  SEXP names = Rf_getAttrib(x, R_NamesSymbol);
+  switch (TYPEOF(x)) {
+  case NILSXP:
+    write_byte(w, 0xc0);
+    return;
+  case RAWSXP:
+    /* Raw vectors are always binary blobs. */
+    write_header(w, len, 0, 0, 0xc4, 0xc5, 0xc6);
+    write_bytes(w, RAW(x), len);
+    return;
+  case LGLSXP:
+  case INTSXP:
+  case REALSXP:
+  case STRSXP:
+    if (names != R_NilValue) {
+      write_map_header(w, len);
+    } else if (len != 1) {
+      write_array_header(w, len);
+    } else {
+      /* Length-one vectors are written as scalars. */
+      write_element(w, x, 0);
+      return;
+    }
+    for (R_xlen_t i = 0; i < len; i++) {
+      if (names != R_NilValue) write_str(w, STRING_ELT(names, i));
+      write_element(w, x, i);
+    }
+    return;
+  case VECSXP:
+    if (Rf_inherits(x, "data.frame")) {
+      write_data_frame(w, x, depth);
+      return;
+    }
+    if (names != R_NilValue) {
+      write_map_header(w, len);
+    } else {
+      write_array_header(w, len);
+    }
+    for (R_xlen_t i = 0; i < len; i++) {
+      if (names != R_NilValue) write_str(w, STRING_ELT(names, i));
+      write_object(w, VECTOR_ELT(x, i), depth + 1);
+    }
+    return;
+  default:
+    Rf_error("Cannot encode a '%s' as MessagePack.", Rf_type2char(TYPEOF(x)));
+  }
+}
+
+SEXP R_amqp_msgpack_encode(SEXP x)
+{
+  msgpack_writer w = {NULL, 0};
+  write_object(&w, x, 0);
+
+  SEXP out = PROTECT(Rf_allocVector(RAWSXP, w.pos));
+  w.out = RAW(out);
+  w.pos = 0;
+  write_object(&w, x, 0);
+
+  UNPROTECT(1);
+  return out;
+}
+
+typedef struct msgpack_reader {
+  const uint8_t *bytes;
+  size_t len;
+  size_t pos;
+  int simplify;
+} msgpack_reader;
+
+static const uint8_t *read_bytes(msgpack_reader *r, size_t len)
+{
+  if (len > r->len - r->pos) {
+    Rf_error("Invalid MessagePack data: unexpected end of input.");
+  }
+  const uint8_t *out = r->bytes + r->pos;
+  r->pos += len;
+  return out;
+}
+
+static uint64_t read_be(msgpack_reader *r, int width)
+{
+  const uint8_t *bytes = read_bytes(r, width);
+  uint64_t out = 0;
+  for (int i = 0; i < width; i++) {
+    out = (out << 8) | bytes[i];
+  }
+  return out;
+}
+
+static SEXP integer_or_double(int64_t value)
+{
+  if (value > INT32_MIN && value <= INT32_MAX) {
+    return Rf_ScalarInteger((int) value);
+  }
+  return Rf_ScalarReal((double) value);
+}
+
+static SEXP read_str(msgpack_reader *r, size_t len)
+{
+  const uint8_t *bytes = read_bytes(r, len);
+  return Rf_ScalarString(Rf_mkCharLenCE((const char *) bytes, len, CE_UTF8));
+}
+
+static SEXP read_bin(msgpack_reader *r, size_t len)
+{
+  const uint8_t *bytes = read_bytes(r, len);
+  SEXP out = Rf_allocVector(RAWSXP, len);
+  if (len > 0) memcpy(RAW(out), bytes, len);
+  return out;
+}
+
+static SEXP read_ext(msgpack_reader *r, size_t len)
+{
+  /* Symbols are never collected, so this can be cached. */
+  static SEXP ext_type_sym = NULL;
+  if (!ext_type_sym) ext_type_sym = Rf_install("msgpack_ext_type");
+
+  int type = (int8_t) read_be(r, 1);
+  SEXP out = PROTECT(read_bin(r, len));
+  SEXP ext_type = PROTECT(Rf_ScalarInteger(type));
+  Rf_setAttrib(out, ext_type_sym, ext_type);
+  UNPROTECT(2);
+  return out;
+}
+
+/* Turn a list of scalars of compatible types into an atomic vector. Missing
+   values (nil) become NA. */
+static SEXP simplify_list(SEXP list)
+{
+  R_xlen_t len = Rf_xlength(list);
+  SEXPTYPE type = NILSXP;
+  for (R_xlen_t i = 0; i < len; i++) {
+    SEXP elt = VECTOR_ELT(list, i);
+    if (elt == R_NilValue) continue;
+    SEXPTYPE elt_type = TYPEOF(elt);
+    if (Rf_xlength(elt) != 1 ||
+        (elt_type != LGLSXP && elt_type != INTSXP && elt_type != REALSXP &&
+         elt_type != STRSXP)) {
+      return list;
+    }
+    if (type == NILSXP || type == elt_type) {
+      type = elt_type;
+    } else if ((type == INTSXP && elt_type == REALSXP) ||
+               (type == REALSXP && elt_type == INTSXP)) {
+      type = REALSXP;
+    } else {
+      return list;
+    }
+  }
+  if (type == NILSXP) return list;
+
+  SEXP out = PROTECT(Rf_allocVector(type, len));
+  for (R_xlen_t i = 0; i < len; i++) {
+    SEXP elt = VECTOR_ELT(list, i);
+    switch (type) {
+    case LGLSXP:
+      LOGICAL(out)[i] = elt == R_NilValue ? NA_LOGICAL : LOGICAL(elt)[0];
+      break;
+    case INTSXP:
+      INTEGER(out)[i] = elt == R_NilValue ? NA_INTEGER : INTEGER(elt)[0];
+      break;
+    case REALSXP:
+      REAL(out)[i] = elt == R_NilValue ? NA_REAL : Rf_asReal(elt);
+      break;
+    default:
+      SET_STRING_ELT(out, i, elt == R_NilValue ? NA_STRING : STRING_ELT(elt, 0));
+      break;
+    }
+  }
+  UNPROTECT(1);
+  return out;
+}
+
+static SEXP read_object(msgpack_reader *r, int depth);
+
+static SEXP read_array(msgpack_reader *r, size_t len, int depth)
+{
+  /* Each element takes at least one byte, so this guards the allocation. */
+  if (len > r->len - r->pos) {
+    Rf_error("Invalid MessagePack data: unexpected end of input.");
+  }
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, len));
+  for (size_t i = 0; i < len; i++) {
+    SET_VECTOR_ELT(out, i, read_object(r, depth + 1));
+  }
+  if (r->simplify) out = simplify_list(out);
+  UNPROTECT(1);
+  return out;
+}
+
+static SEXP read_map(msgpack_reader *r, size_t len, int depth)
+{
+  if (len > (r->len - r->pos) / 2) {
+    Rf_error("Invalid MessagePack data: unexpected end of input.");
+  }
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, len));
+  SEXP names = PROTECT(Rf_allocVector(STRSXP, len));
+  for (size_t i = 0; i < len; i++) {
+    SEXP key = read_object(r, depth + 1);
+    if (TYPEOF(key) != STRSXP || Rf_xlength(key) != 1) {
+      /* Other scalar keys (e.g. integers) are converted to names. */
+      if (!Rf_isVectorAtomic(key) || Rf_xlength(key) != 1) {
+        Rf_error("Invalid MessagePack data: map keys must be scalars.");
+      }
+      key = Rf_coerceVector(PROTECT(key), STRSXP);
+      UNPROTECT(1);
+    }
+    SET_STRING_ELT(names, i, STRING_ELT(key, 0));
+    SET_VECTOR_ELT(out, i, read_object(r, depth + 1));
+  }
+  Rf_setAttrib(out, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return out;
+}
+
+static SEXP read_object(msgpack_reader *r, int depth)
+{
+  if (depth > MSGPACK_MAX_DEPTH) {
+    Rf_error("Cannot decode objects nested more than %d levels deep.",
+             MSGPACK_MAX_DEPTH);
+  }
+
+  uint8_t byte = *read_bytes(r, 1);
+  if (byte <= 0x7f) {
+    return Rf_ScalarInteger(byte);
+  } else if (byte >= 0xe0) {
+    return Rf_ScalarInteger((int8_t) byte);
+  } else if ((byte & 0xe0) == 0xa0) {
+    return read_str(r, byte & 0x1f);
+  } else if ((byte & 0xf0) == 0x90) {
+    return read_array(r, byte & 0x0f, depth);
+  } else if ((byte & 0xf0) == 0x80) {
+    return read_map(r, byte & 0x0f, depth);
+  }
+
+  switch (byte) {
+  case 0xc0:
+    return R_NilValue;
+  case 0xc2:
+    return Rf_ScalarLogical(0);
+  case 0xc3:
+    return Rf_ScalarLogical(1);
+  case 0xc4:
+    return read_bin(r, read_be(r, 1));
+  case 0xc5:
+    return read_bin(r, read_be(r, 2));
+  case 0xc6:
+    return read_bin(r, read_be(r, 4));
+  case 0xc7:
+    return read_ext(r, read_be(r, 1));
+  case 0xc8:
+    return read_ext(r, read_be(r, 2));
+  case 0xc9:
+    return read_ext(r, read_be(r, 4));
+  case 0xca: {
+    uint32_t bits = (uint32_t) read_be(r, 4);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return Rf_ScalarReal(value);
+  }
+  case 0xcb: {
+    uint64_t bits = read_be(r, 8);
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return Rf_ScalarReal(value);
+  }
+  case 0xcc:
+    return integer_or_double(read_be(r, 1));
+  case 0xcd:
+    return integer_or_double(read_be(r, 2));
+  case 0xce:
+    return integer_or_double(read_be(r, 4));
+  case 0xcf:
+    /* Unsigned 64-bit integers may lose precision. */
+    return Rf_ScalarReal((double) read_be(r, 8));
+  case 0xd0:
+    return integer_or_double((int8_t) read_be(r, 1));
+  case 0xd1:
+    return integer_or_double((int16_t) read_be(r, 2));
+  case 0xd2:
+    return integer_or_double((int32_t) read_be(r, 4));
+  case 0xd3:
+    return integer_or_double((int64_t) read_be(r, 8));
+  case 0xd4:
+    return read_ext(r, 1);
+  case 0xd5:
+    return read_ext(r, 2);
+  case 0xd6:
+    return read_ext(r, 4);
+  case 0xd7:
+    return read_ext(r, 8);
+  case 0xd8:
+    return read_ext(r, 16);
+  case 0xd9:
+    return read_str(r, read_be(r, 1));
+  case 0xda:
+    return read_str(r, read_be(r, 2));
+  case 0xdb:
+    return read_str(r, read_be(r, 4));
+  case 0xdc:
+    return read_array(r, read_be(r, 2), depth);
+  case 0xdd:
+    return read_array(r, read_be(r, 4), depth);
+  case 0xde:
+    return read_map(r, read_be(r, 2), depth);
+  case 0xdf:
+    return read_map(r, read_be(r, 4), depth);
+  default:
+    Rf_error("Invalid MessagePack data: unknown type byte 0x%02x.", byte);
+  }
+  return R_NilValue;
+}
+
+SEXP R_amqp_msgpack_decode(SEXP body, SEXP simplify)
+{
+  msgpack_reader r;
+  r.bytes = RAW(body);
+  r.len = XLENGTH(body);
+  r.pos = 0;
+  r.simplify = Rf_asLogical(simplify) == 1;
+
+  SEXP out = PROTECT(read_object(&r, 0));
+  if (r.pos != r.len) {
+    Rf_error("Invalid MessagePack data: %zu trailing bytes.", r.len - r.pos);
+  }
+  UNPROTECT(1);
+  return out;
+}
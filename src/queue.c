@@ -10,8 +10,11 @@ SEXP R_amqp_declare_queue(SEXP ptr, SEXP queue, SEXP passive, SEXP durable,
                           SEXP exclusive, SEXP auto_delete, SEXP args)
 {
   connection *conn = (connection *) R_ExternalPtrAddr(ptr);
+  conn_lock(conn);
   char errbuff[200];
   if (ensure_valid_channel(conn, &conn->chan, errbuff, 200) < 0) {
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to find an open channel. %s", errbuff);
     return R_NilValue;
   }
@@ -30,9 +33,21 @@ SEXP R_amqp_declare_queue(SEXP ptr, SEXP queue, SEXP passive, SEXP durable,
   if (queue_ok == NULL) {
     amqp_rpc_reply_t reply = amqp_get_rpc_reply(conn->conn);
     render_amqp_error(reply, conn, &conn->chan, errbuff, 200);
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to declare queue. %s", errbuff);
   }
 
+  /* Server-named queues can't be redeclared with the same name, so they are
+     not recovered. */
+  if (!is_passive && queue_str.len > 0) {
+    int flags = (is_durable ? TOPOLOGY_DURABLE : 0) |
+      (is_auto_delete ? TOPOLOGY_AUTO_DELETE : 0) |
+      (is_exclusive ? TOPOLOGY_EXCLUSIVE : 0);
+    record_topology(conn, TOPOLOGY_QUEUE, queue_str, amqp_empty_bytes,
+                    amqp_empty_bytes, flags, arg_table);
+  }
+
   SEXP out = PROTECT(allocVector(VECSXP, 3));
   SEXP names = PROTECT(allocVector(STRSXP, 3));
   SEXP qname = PROTECT(mkCharLen(queue_ok->queue.bytes, queue_ok->queue.len));
@@ -47,6 +62,8 @@ SEXP R_amqp_declare_queue(SEXP ptr, SEXP queue, SEXP passive, SEXP durable,
   setAttrib(out, R_NamesSymbol, names);
   setAttrib(out, R_ClassSymbol, ScalarString(mkChar("amqp_queue")));
 
+  conn_unlock(conn);
+  raise_warnings(conn);
   UNPROTECT(3);
   return out;
 }
@@ -54,8 +71,11 @@ SEXP R_amqp_declare_queue(SEXP ptr, SEXP queue, SEXP passive, SEXP durable,
 SEXP R_amqp_delete_queue(SEXP ptr, SEXP queue, SEXP if_unused, SEXP if_empty)
 {
   connection *conn = (connection *) R_ExternalPtrAddr(ptr);
+  conn_lock(conn);
   char errbuff[200];
   if (ensure_valid_channel(conn, &conn->chan, errbuff, 200) < 0) {
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to find an open channel. %s", errbuff);
     return R_NilValue;
   }
@@ -70,8 +90,18 @@ SEXP R_amqp_delete_queue(SEXP ptr, SEXP queue, SEXP if_unused, SEXP if_empty)
   if (delete_ok == NULL) {
     amqp_rpc_reply_t reply = amqp_get_rpc_reply(conn->conn);
     render_amqp_error(reply, conn, &conn->chan, errbuff, 200);
+    conn_unlock(conn);
+    raise_warnings(conn);
     Rf_error("Failed to delete queue. %s", errbuff);
   }
 
-  return ScalarInteger(delete_ok->message_count);
+  /* The reply is only valid until another thread (e.g. the heartbeat thread)
+     uses the connection. */
+  int message_count = delete_ok->message_count;
+  forget_topology(conn, TOPOLOGY_QUEUE, queue_str, amqp_empty_bytes,
+                  amqp_empty_bytes);
+
+  conn_unlock(conn);
+  raise_warnings(conn);
+  return ScalarInteger(message_count);
 }
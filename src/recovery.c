@@ -0,0 +1,436 @@
+#include <stdarg.h> /* for va_list */
+#include <stdio.h> /* for snprintf, vsnprintf */
+#include <stdlib.h> /* for malloc, free */
+#include <string.h> /* for memcmp, memcpy */
+#include <time.h> /* for nanosleep */
+
+#include <amqp.h>
+#include <amqp_framing.h>
+
+#include "connection.h"
+#include "utils.h"
+
+/* Connections created with recover = TRUE keep a record of the exchanges,
+   queues, and bindings declared on them (in declaration order) as well as what
+   is needed to restart consumers. When the connection is re-established, these
+   are replayed so that the application can carry on where it left off. */
+
+typedef struct topology {
+  topology_kind kind;
+  amqp_bytes_t name; /* The exchange, queue, or binding destination. */
+  amqp_bytes_t source; /* The exchange type or binding source. */
+  amqp_bytes_t routing_key;
+  int flags;
+  amqp_table_t args;
+  amqp_pool_t pool;
+  struct topology *next;
+} topology;
+
+static amqp_bytes_t pool_bytes_dup(amqp_pool_t *pool, amqp_bytes_t in)
+{
+  amqp_bytes_t out = amqp_empty_bytes;
+  if (in.len) {
+    amqp_pool_alloc_bytes(pool, in.len, &out);
+    memcpy(out.bytes, in.bytes, in.len);
+  }
+  return out;
+}
+
+static int bytes_equal(amqp_bytes_t a, amqp_bytes_t b)
+{
+  return a.len == b.len && (a.len == 0 || memcmp(a.bytes, b.bytes, a.len) == 0);
+}
+
+static void free_topology(topology *elt)
+{
+  empty_amqp_pool(&elt->pool);
+  free(elt);
+}
+
+/* Remove records matching the predicate. */
+static void remove_topology(connection *conn, int (*matches)(const topology *,
+                                                             const topology *),
+                            const topology *key)
+{
+  topology *prev = NULL, *next, *elt = conn->topology;
+  while (elt) {
+    next = elt->next;
+    if (matches(elt, key)) {
+      if (prev) {
+        prev->next = next;
+      } else {
+        conn->topology = next;
+      }
+      free_topology(elt);
+    } else {
+      prev = elt;
+    }
+    elt = next;
+  }
+}
+
+static int same_record(const topology *elt, const topology *key)
+{
+  return elt->kind == key->kind && bytes_equal(elt->name, key->name) &&
+    ((key->kind != TOPOLOGY_QUEUE_BINDING &&
+      key->kind != TOPOLOGY_EXCHANGE_BINDING) ||
+     (bytes_equal(elt->source, key->source) &&
+      bytes_equal(elt->routing_key, key->routing_key)));
+}
+
+/* Deleted queues and exchanges take their bindings with them. */
+static int same_or_dependent_record(const topology *elt, const topology *key)
+{
+  if (same_record(elt, key)) return 1;
+  if (key->kind == TOPOLOGY_QUEUE) {
+    return elt->kind == TOPOLOGY_QUEUE_BINDING &&
+      bytes_equal(elt->name, key->name);
+  } else if (key->kind == TOPOLOGY_EXCHANGE) {
+    return (elt->kind == TOPOLOGY_QUEUE_BINDING &&
+            bytes_equal(elt->source, key->name)) ||
+      (elt->kind == TOPOLOGY_EXCHANGE_BINDING &&
+       (bytes_equal(elt->source, key->name) ||
+        bytes_equal(elt->name, key->name)));
+  }
+  return 0;
+}
+
+void record_topology(connection *conn, topology_kind kind, amqp_bytes_t name,
+                     amqp_bytes_t source, amqp_bytes_t routing_key, int flags,
+                     const amqp_table_t *args)
+{
+  if (!conn->recover) return;
+
+  topology *out = malloc(sizeof(topology));
+  init_amqp_pool(&out->pool, 512);
+  out->kind = kind;
+  out->name = pool_bytes_dup(&out->pool, name);
+  out->source = pool_bytes_dup(&out->pool, source);
+  out->routing_key = pool_bytes_dup(&out->pool, routing_key);
+  out->flags = flags;
+  out->args = amqp_empty_table;
+  if (args && amqp_table_clone(args, &out->args, &out->pool) != AMQP_STATUS_OK) {
+    out->args = amqp_empty_table;
+  }
+  out->next = NULL;
+
+  /* Redeclarations replace the original record. */
+  remove_topology(conn, same_record, out);
+
+  if (!conn->topology) {
+    conn->topology = out;
+  } else {
+    topology *elt = conn->topology;
+    while (elt->next) {
+      elt = elt->next;
+    }
+    elt->next = out;
+  }
+}
+
+void forget_topology(connection *conn, topology_kind kind, amqp_bytes_t name,
+                     amqp_bytes_t source, amqp_bytes_t routing_key)
+{
+  if (!conn->topology) return;
+
+  topology key;
+  key.kind = kind;
+  key.name = name;
+  key.source = source;
+  key.routing_key = routing_key;
+  remove_topology(conn, same_or_dependent_record, &key);
+}
+
+void destroy_topology(connection *conn)
+{
+  topology *next, *elt = conn->topology;
+  while (elt) {
+    next = elt->next;
+    free_topology(elt);
+    elt = next;
+  }
+  conn->topology = NULL;
+}
+
+static const char *topology_kind_name(topology_kind kind)
+{
+  switch (kind) {
+  case TOPOLOGY_EXCHANGE:
+    return "exchange";
+  case TOPOLOGY_QUEUE:
+    return "queue";
+  case TOPOLOGY_QUEUE_BINDING:
+    return "binding for queue";
+  case TOPOLOGY_EXCHANGE_BINDING:
+    return "binding for exchange";
+  }
+  return "declaration";
+}
+
+static void *replay_topology(connection *conn, const topology *elt)
+{
+  switch (elt->kind) {
+  case TOPOLOGY_EXCHANGE: {
+    amqp_exchange_declare_t method;
+    method.ticket = 0;
+    method.exchange = elt->name;
+    method.type = elt->source;
+    method.passive = 0;
+    method.durable = (elt->flags & TOPOLOGY_DURABLE) != 0;
+    method.auto_delete = (elt->flags & TOPOLOGY_AUTO_DELETE) != 0;
+    method.internal = (elt->flags & TOPOLOGY_INTERNAL) != 0;
+    method.nowait = 0;
+    method.arguments = elt->args;
+    return amqp_simple_rpc_decoded(conn->conn, conn->chan.chan,
+                                   AMQP_EXCHANGE_DECLARE_METHOD,
+                                   AMQP_EXCHANGE_DECLARE_OK_METHOD, &method);
+  }
+  case TOPOLOGY_QUEUE: {
+    amqp_queue_declare_t method;
+    method.ticket = 0;
+    method.queue = elt->name;
+    method.passive = 0;
+    method.durable = (elt->flags & TOPOLOGY_DURABLE) != 0;
+    method.exclusive = (elt->flags & TOPOLOGY_EXCLUSIVE) != 0;
+    method.auto_delete = (elt->flags & TOPOLOGY_AUTO_DELETE) != 0;
+    method.nowait = 0;
+    method.arguments = elt->args;
+    return amqp_simple_rpc_decoded(conn->conn, conn->chan.chan,
+                                   AMQP_QUEUE_DECLARE_METHOD,
+                                   AMQP_QUEUE_DECLARE_OK_METHOD, &method);
+  }
+  case TOPOLOGY_QUEUE_BINDING: {
+    amqp_queue_bind_t method;
+    method.ticket = 0;
+    method.queue = elt->name;
+    method.exchange = elt->source;
+    method.routing_key = elt->routing_key;
+    method.nowait = 0;
+    method.arguments = elt->args;
+    return amqp_simple_rpc_decoded(conn->conn, conn->chan.chan,
+                                   AMQP_QUEUE_BIND_METHOD,
+                                   AMQP_QUEUE_BIND_OK_METHOD, &method);
+  }
+  case TOPOLOGY_EXCHANGE_BINDING: {
+    amqp_exchange_bind_t method;
+    method.ticket = 0;
+    method.destination = elt->name;
+    method.source = elt->source;
+    method.routing_key = elt->routing_key;
+    method.nowait = 0;
+    method.arguments = elt->args;
+    return amqp_simple_rpc_decoded(conn->conn, conn->chan.chan,
+                                   AMQP_EXCHANGE_BIND_METHOD,
+                                   AMQP_EXCHANGE_BIND_OK_METHOD, &method);
+  }
+  }
+  return NULL;
+}
+
+int recover_topology(connection *conn, char *buffer, size_t len)
+{
+  /* Replay each declaration synchronously, rather than pipelining them with
+     nowait. Otherwise one failure (e.g. a binding for a server-named queue,
+     which is never recorded) closes the channel and silently drops everything
+     after it. */
+  char errbuff[200];
+  topology *elt = conn->topology;
+  while (elt) {
+    if (ensure_valid_channel(conn, &conn->chan, buffer, len) < 0) {
+      return -1;
+    }
+    if (replay_topology(conn, elt) == NULL) {
+      amqp_rpc_reply_t reply = amqp_get_rpc_reply(conn->conn);
+      render_amqp_error(reply, conn, &conn->chan, errbuff, 200);
+      if (!conn->is_connected) {
+        snprintf(buffer, len, "%s", errbuff);
+        return -1;
+      }
+      /* The server will have closed the channel, but we can carry on with the
+         rest on a new one. */
+      defer_warning(conn, "Failed to recover %s '%.*s'. %s",
+                    topology_kind_name(elt->kind), (int) elt->name.len,
+                    (const char *) elt->name.bytes, errbuff);
+    }
+    elt = elt->next;
+  }
+
+  return 0;
+}
+
+void init_consumer_spec(consumer_spec *spec, amqp_bytes_t queue, int no_ack,
+                        int exclusive, int prefetch_count,
+                        const amqp_table_t *args)
+{
+  init_amqp_pool(&spec->pool, 512);
+  spec->queue = pool_bytes_dup(&spec->pool, queue);
+  spec->no_ack = no_ack;
+  spec->exclusive = exclusive;
+  spec->prefetch_count = prefetch_count;
+  spec->args = amqp_empty_table;
+  if (args &&
+      amqp_table_clone(args, &spec->args, &spec->pool) != AMQP_STATUS_OK) {
+    spec->args = amqp_empty_table;
+  }
+}
+
+void destroy_consumer_spec(consumer_spec *spec)
+{
+  empty_amqp_pool(&spec->pool);
+}
+
+int restart_consumer(connection *conn, channel *chan, amqp_bytes_t tag,
+                     const consumer_spec *spec, char *buffer, size_t len)
+{
+  chan->is_open = 0;
+  if (ensure_valid_channel(conn, chan, buffer, len) < 0) {
+    return -1;
+  }
+
+  amqp_basic_qos_ok_t *qos_ok = amqp_basic_qos(conn->conn, chan->chan, 0,
+                                               spec->prefetch_count, 0);
+  if (qos_ok == NULL) {
+    amqp_rpc_reply_t reply = amqp_get_rpc_reply(conn->conn);
+    render_amqp_error(reply, conn, chan, buffer, len);
+    return -1;
+  }
+
+  /* Reuse the original tag, so that existing consumer objects still work. This
+     is synchronous (unlike the topology) so that we know which consumers could
+     not be recovered, e.g. because their queue is gone. */
+  amqp_basic_consume_ok_t *consume_ok;
+  consume_ok = amqp_basic_consume(conn->conn, chan->chan, spec->queue, tag, 0,
+                                  spec->no_ack, spec->exclusive, spec->args);
+  if (consume_ok == NULL) {
+    amqp_rpc_reply_t reply = amqp_get_rpc_reply(conn->conn);
+    render_amqp_error(reply, conn, chan, buffer, len);
+    return -1;
+  }
+
+  return 0;
+}
+
+double backoff_delay(const connection *conn, int attempt)
+{
+  /* Exponential backoff, capped at 30 seconds. */
+  double delay = conn->recover_backoff;
+  for (int i = 0; i < attempt && delay < 30; i++) {
+    delay *= 2;
+  }
+  return delay < 30 ? delay : 30;
+}
+
+/* Backoff delays are slept in slices of this many seconds, so that the user
+   can interrupt, and no more than RECOVER_MAX_WAIT seconds are spent waiting
+   in total. */
+#define RECOVER_SLICE 0.1
+#define RECOVER_MAX_WAIT 60
+
+static void check_interrupt(void *data)
+{
+  R_CheckUserInterrupt();
+}
+
+/* Wait between attempts without holding the connection's mutex. Returns -1 if
+   the user interrupted. */
+static int wait_to_reconnect(connection *conn, double delay)
+{
+  struct timespec sleeptime;
+  double slice;
+  int interrupted = 0;
+
+  conn_unlock(conn);
+  while (delay > 0 && !interrupted) {
+    slice = delay < RECOVER_SLICE ? delay : RECOVER_SLICE;
+    sleeptime.tv_sec = (time_t) slice;
+    sleeptime.tv_nsec = (long) ((slice - sleeptime.tv_sec) * 1e9);
+    nanosleep(&sleeptime, NULL);
+    delay -= slice;
+    /* R_CheckUserInterrupt() jumps on an interrupt, so catch that here. */
+    interrupted = !R_ToplevelExec(check_interrupt, NULL);
+  }
+  conn_lock(conn);
+
+  return interrupted ? -1 : 0;
+}
+
+/* This must only be called on the main thread, with the mutex held. */
+int reconnect_with_backoff(connection *conn, char *buffer, size_t len)
+{
+  double delay, waited = 0;
+  int res = -1;
+
+  conn->recovering = 1;
+  for (int i = 0; i < conn->recover_attempts && res < 0; i++) {
+    if (i > 0) {
+      delay = backoff_delay(conn, i - 1);
+      if (waited + delay > RECOVER_MAX_WAIT) {
+        delay = RECOVER_MAX_WAIT - waited;
+      }
+      if (delay <= 0) {
+        /* Keep the error from the last attempt. */
+        break;
+      }
+      if (wait_to_reconnect(conn, delay) < 0) {
+        snprintf(buffer, len, "Interrupted while reconnecting.");
+        break;
+      }
+      waited += delay;
+    }
+    res = lconnect(conn, buffer, len);
+  }
+  conn->recovering = 0;
+
+  return res;
+}
+
+/* Recovery happens with the connection's mutex held, so warnings are queued
+   here instead of being raised straight away. The caller must hold the
+   mutex. */
+void defer_warning(connection *conn, const char *fmt, ...)
+{
+  deferred_warning *elt = malloc(sizeof(deferred_warning));
+  if (!elt) return;
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(elt->msg, sizeof(elt->msg), fmt, args);
+  va_end(args);
+  elt->next = NULL;
+
+  deferred_warning **tail = &conn->warnings;
+  while (*tail) {
+    tail = &(*tail)->next;
+  }
+  *tail = elt;
+}
+
+/* Raise any queued warnings. This must only be called on the main thread, and
+   without holding the mutex. Each warning is removed before it is raised, so
+   if one is turned into an error the rest are kept for next time. */
+void raise_warnings(connection *conn)
+{
+  char msg[200];
+  for (;;) {
+    conn_lock(conn);
+    deferred_warning *elt = conn->warnings;
+    if (!elt) {
+      conn_unlock(conn);
+      return;
+    }
+    conn->warnings = elt->next;
+    conn_unlock(conn);
+
+    memcpy(msg, elt->msg, sizeof(msg));
+    free(elt);
+    Rf_warning("%s", msg);
+  }
+}
+
+void clear_warnings(connection *conn)
+{
+  while (conn->warnings) {
+    deferred_warning *next = conn->warnings->next;
+    free(conn->warnings);
+    conn->warnings = next;
+  }
+}
@@ -5,7 +5,7 @@
 #include "tables.h"
 #include "utils.h"
 
-void encode_value(const SEXP in, amqp_field_value_t *out)
+void encode_value(const SEXP in, amqp_field_value_t *out, amqp_pool_t *pool)
 {
   if (Rf_length(in) == 0) {
     out->kind = AMQP_FIELD_KIND_VOID;
@@ -21,7 +21,8 @@ void encode_value(const SEXP in, amqp_field_value_t *out)
     } else {
       out->kind = AMQP_FIELD_KIND_ARRAY;
       out->value.array.num_entries = len;
-      out->value.array.entries = calloc(len, sizeof(amqp_field_value_t));
+      out->value.array.entries =
+        amqp_pool_alloc(pool, len * sizeof(amqp_field_value_t));
       for (int i = 0; i < len; i++) {
         out->value.array.entries[i].kind = AMQP_FIELD_KIND_BOOLEAN;
         out->value.array.entries[i].value.boolean = values[i];
@@ -37,7 +38,8 @@ void encode_value(const SEXP in, amqp_field_value_t *out)
     } else {
       out->kind = AMQP_FIELD_KIND_ARRAY;
       out->value.array.num_entries = len;
-      out->value.array.entries = calloc(len, sizeof(amqp_field_value_t));
+      out->value.array.entries =
+        amqp_pool_alloc(pool, len * sizeof(amqp_field_value_t));
       for (int i = 0; i < len; i++) {
         out->value.array.entries[i].kind = AMQP_FIELD_KIND_I32;
         out->value.array.entries[i].value.i32 = values[i];
@@ -54,7 +56,8 @@ void encode_value(const SEXP in, amqp_field_value_t *out)
     } else {
       out->kind = AMQP_FIELD_KIND_ARRAY;
       out->value.array.num_entries = len;
-      out->value.array.entries = calloc(len, sizeof(amqp_field_value_t));
+      out->value.array.entries =
+        amqp_pool_alloc(pool, len * sizeof(amqp_field_value_t));
       for (int i = 0; i < len; i++) {
         out->value.array.entries[i].kind = AMQP_FIELD_KIND_F64;
         out->value.array.entries[i].value.f64 = values[i];
@@ -70,7 +73,8 @@ void encode_value(const SEXP in, amqp_field_value_t *out)
     } else {
       out->kind = AMQP_FIELD_KIND_ARRAY;
       out->value.array.num_entries = len;
-      out->value.array.entries = calloc(len, sizeof(amqp_field_value_t));
+      out->value.array.entries =
+        amqp_pool_alloc(pool, len * sizeof(amqp_field_value_t));
       for (int i = 0; i < len; i++) {
         out->value.array.entries[i].kind = AMQP_FIELD_KIND_UTF8;
         out->value.array.entries[i].value.bytes =
@@ -82,7 +86,7 @@ void encode_value(const SEXP in, amqp_field_value_t *out)
   case RAWSXP: {
     int len = Rf_length(in);
     out->kind = AMQP_FIELD_KIND_BYTES;
-    out->value.bytes = amqp_bytes_malloc(len);
+    amqp_pool_alloc_bytes(pool, len, &out->value.bytes);
     memcpy(out->value.bytes.bytes, RAW_RO(in), len);
     break;
   }
@@ -91,14 +95,15 @@ void encode_value(const SEXP in, amqp_field_value_t *out)
     int len = Rf_length(in);
     if (R_NilValue != Rf_getAttrib(in, R_NamesSymbol)) {
       out->kind = AMQP_FIELD_KIND_TABLE;
-      encode_table(in, &out->value.table, 1);
+      encode_table(in, &out->value.table, pool);
       break;
     }
     out->kind = AMQP_FIELD_KIND_ARRAY;
     out->value.array.num_entries = len;
-    out->value.array.entries = calloc(len, sizeof(amqp_field_value_t));
+    out->value.array.entries =
+        amqp_pool_alloc(pool, len * sizeof(amqp_field_value_t));
     for (int i = 0; i < len; i++) {
-      encode_value(VECTOR_ELT(in, i), &out->value.array.entries[i]);
+      encode_value(VECTOR_ELT(in, i), &out->value.array.entries[i], pool);
     }
     break;
   }
@@ -112,14 +117,12 @@ void encode_value(const SEXP in, amqp_field_value_t *out)
   return;
 }
 
-void encode_table(const SEXP list, amqp_table_t *table, int alloc)
+void encode_table(const SEXP list, amqp_table_t *table, amqp_pool_t *pool)
 {
   SEXP names = PROTECT(Rf_getAttrib(list, R_NamesSymbol));
   size_t n = Rf_length(list);
   table->num_entries = (int) n;
-  if (alloc) {
-    table->entries = calloc(n, sizeof(amqp_table_entry_t));
-  }
+  table->entries = amqp_pool_alloc(pool, n * sizeof(amqp_table_entry_t));
 
   SEXP elt, name;
   for (int i = 0; i < Rf_length(list); i++) {
@@ -127,14 +130,14 @@ void encode_table(const SEXP list, amqp_table_t *table, int alloc)
     name = STRING_ELT(names, i);
 
     table->entries[i].key = charsxp_to_amqp_bytes(name);
-    encode_value(elt, &table->entries[i].value);
+    encode_value(elt, &table->entries[i].value, pool);
   }
 
   UNPROTECT(1);
   return;
 }
 
-SEXP decode_field_value(amqp_field_value_t value)
+SEXP decode_field_value(amqp_field_value_t value, connection *conn)
 {
   switch (value.kind) {
   case AMQP_FIELD_KIND_VOID:
@@ -180,14 +183,15 @@ SEXP decode_field_value(amqp_field_value_t value)
     int n = value.value.array.num_entries;
     SEXP out = PROTECT(Rf_allocVector(VECSXP, n));
     for (int i = 0; i < n; i++) {
-      SET_VECTOR_ELT(out, i, decode_field_value(value.value.array.entries[i]));
+      SET_VECTOR_ELT(out, i, decode_field_value(value.value.array.entries[i],
+                                                conn));
     }
     UNPROTECT(1);
     return out;
   }
 
   case AMQP_FIELD_KIND_TABLE:
-    return decode_table(&value.value.table);
+    return decode_table(&value.value.table, conn);
     break;
 
     /* No obvious equivalents. */
@@ -204,7 +208,7 @@ SEXP decode_field_value(amqp_field_value_t value)
   return R_NilValue;
 }
 
-SEXP decode_table(amqp_table_t *table)
+SEXP decode_table(amqp_table_t *table, connection *conn)
 {
   if (!table || table->num_entries == 0) {
     return empty_named_list;
@@ -214,8 +218,8 @@ SEXP decode_table(amqp_table_t *table)
   SEXP names = PROTECT(Rf_allocVector(STRSXP, table->num_entries));
 
   for (int i = 0; i < table->num_entries; i++) {
-    SET_STRING_ELT(names, i, amqp_bytes_to_char(&table->entries[i].key));
-    SET_VECTOR_ELT(out, i, decode_field_value(table->entries[i].value));
+    SET_STRING_ELT(names, i, cached_char(conn, &table->entries[i].key));
+    SET_VECTOR_ELT(out, i, decode_field_value(table->entries[i].value, conn));
   }
 
   Rf_setAttrib(out, R_NamesSymbol, names);
@@ -223,51 +227,21 @@ SEXP decode_table(amqp_table_t *table)
   return out;
 }
 
-static void free_value(amqp_field_value_t *value)
-{
-  /* Some field kinds allocate memory; release it here. */
-  switch (value->kind) {
-  case AMQP_FIELD_KIND_UTF8:
-    break;
-
-  case AMQP_FIELD_KIND_BYTES: {
-    amqp_bytes_free(value->value.bytes);
-    break;
-  }
-  case AMQP_FIELD_KIND_ARRAY: {
-    for (int i = 0; i < value->value.array.num_entries; i++) {
-      free_value(&value->value.array.entries[i]);
-    }
-    free(value->value.array.entries);
-    break;
-  }
-  case AMQP_FIELD_KIND_TABLE:
-    for (int i = 0; i < value->value.table.num_entries; i++) {
-      free_value(&value->value.table.entries[i].value);
-    }
-    free(value->value.table.entries);
-    break;
-  default:
-    break;
-  }
-}
-
 static void R_finalize_amqp_table(SEXP ptr)
 {
-  amqp_table_t *table = (amqp_table_t *) R_ExternalPtrAddr(ptr);
+  encoded_table *table = (encoded_table *) R_ExternalPtrAddr(ptr);
   if (table) {
-    for (int i = 0; i < table->num_entries; i++) {
-      free_value(&table->entries[i].value);
-    }
-    free(table->entries);
+    /* Everything the table refers to lives in the pool. */
+    empty_amqp_pool(&table->pool);
     free(table);
   }
   R_ClearExternalPtr(ptr);
 }
 
-SEXP R_table_object(amqp_table_t *table)
+SEXP R_table_object(encoded_table *table, SEXP list)
 {
-  SEXP ptr = PROTECT(R_MakeExternalPtr(table, R_NilValue, R_NilValue));
+  /* Strings in the table point into the list, so keep it alive, too. */
+  SEXP ptr = PROTECT(R_MakeExternalPtr(table, R_NilValue, list));
   R_RegisterCFinalizerEx(ptr, R_finalize_amqp_table, 1);
 
   /* Create the "amqp_table" object. */
@@ -285,9 +259,16 @@ SEXP R_amqp_encode_table(SEXP list)
   if (Rf_xlength(list) == 0) {
     return empty_table_object;
   }
-  amqp_table_t *table = malloc(sizeof(amqp_table_t));
-  encode_table(list, table, 1);
-  return R_table_object(table);
+  encoded_table *table = malloc(sizeof(encoded_table));
+  init_amqp_pool(&table->pool, ENCODING_POOL_PAGESIZE);
+  table->table.num_entries = 0;
+
+  /* Wrap the table before encoding it, so that the memory is still reclaimed
+     if encoding fails (e.g. when warnings are turned into errors). */
+  SEXP out = PROTECT(R_table_object(table, list));
+  encode_table(list, &table->table, &table->pool);
+  UNPROTECT(1);
+  return out;
 }
 
 SEXP R_amqp_decode_table(SEXP ptr)
@@ -295,5 +276,5 @@ SEXP R_amqp_decode_table(SEXP ptr)
   amqp_table_t *table = (amqp_table_t *) R_ExternalPtrAddr(ptr);
   if (!table)
     Rf_error("Table object is no longer valid.");
-  return decode_table(table);
+  return decode_table(table, NULL);
 }
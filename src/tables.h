@@ -3,14 +3,34 @@
 
 #include <Rinternals.h>
 #include <amqp.h>
+#include <amqp_framing.h> /* for amqp_basic_properties_t */
+
+#include "connection.h" /* for connection */
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-void encode_table(SEXP list, amqp_table_t *table, int alloc);
-void encode_value(const SEXP in, amqp_field_value_t *out);
-SEXP decode_table(amqp_table_t *table);
+/* Encoded tables and properties own all of the memory they refer to through a
+   single pool, so that they can be released as a unit. The encoded value comes
+   first, so that pointers to these structures can be passed around as
+   pointers to the value itself. */
+
+#define ENCODING_POOL_PAGESIZE 512
+
+typedef struct encoded_table {
+  amqp_table_t table;
+  amqp_pool_t pool;
+} encoded_table;
+
+typedef struct encoded_properties {
+  amqp_basic_properties_t props;
+  amqp_pool_t pool;
+} encoded_properties;
+
+void encode_table(SEXP list, amqp_table_t *table, amqp_pool_t *pool);
+void encode_value(const SEXP in, amqp_field_value_t *out, amqp_pool_t *pool);
+SEXP decode_table(amqp_table_t *table, connection *conn);
 
 
 #ifdef __cplusplus
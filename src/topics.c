@@ -0,0 +1,191 @@
+#include <stdlib.h> /* for malloc, free */
+#include <string.h> /* for memcmp, memcpy */
+
+#include <amqp.h>
+
+#include "longears.h"
+
+/* Dispatching messages on topic patterns, as used for bindings to topic
+   exchanges. Patterns are compiled into a trie over their dot-separated
+   words, with separate edges for the "*" (exactly one word) and "#" (zero or
+   more words) wildcards, so that a routing key can be matched against all of
+   them in one pass rather than testing each pattern in turn. */
+
+/* Routing keys are AMQP short strings. Words can be empty (as in "a..b"), so
+   a key can have one more word than it has bytes. */
+#define MAX_TOPIC_LEN 255
+#define MAX_TOPIC_WORDS (MAX_TOPIC_LEN + 1)
+
+typedef struct topic_node {
+  amqp_bytes_t word;
+  /* The index of the first pattern ending at this node, or -1. */
+  int index;
+  struct topic_node *children;
+  struct topic_node *sibling;
+  struct topic_node *star;
+  struct topic_node *hash;
+} topic_node;
+
+typedef struct topic_trie {
+  topic_node *root;
+  amqp_pool_t pool;
+} topic_trie;
+
+static topic_node *new_node(amqp_pool_t *pool, const char *word, size_t len)
+{
+  topic_node *node = amqp_pool_alloc(pool, sizeof(topic_node));
+  node->word.len = len;
+  node->word.bytes = amqp_pool_alloc(pool, len > 0 ? len : 1);
+  memcpy(node->word.bytes, word, len);
+  node->index = -1;
+  node->children = NULL;
+  node->sibling = NULL;
+  node->star = NULL;
+  node->hash = NULL;
+  return node;
+}
+
+static topic_node *child_node(amqp_pool_t *pool, topic_node *parent,
+                              const char *word, size_t len)
+{
+  if (len == 1 && word[0] == '*') {
+    if (!parent->star) parent->star = new_node(pool, word, len);
+    return parent->star;
+  } else if (len == 1 && word[0] == '#') {
+    if (!parent->hash) parent->hash = new_node(pool, word, len);
+    return parent->hash;
+  }
+
+  topic_node *elt = parent->children;
+  while (elt) {
+    if (elt->word.len == len && memcmp(elt->word.bytes, word, len) == 0) {
+      return elt;
+    }
+    elt = elt->sibling;
+  }
+  elt = new_node(pool, word, len);
+  elt->sibling = parent->children;
+  parent->children = elt;
+  return elt;
+}
+
+static void insert_pattern(topic_trie *trie, const char *pattern, size_t len,
+                           int index)
+{
+  topic_node *node = trie->root;
+  size_t start = 0;
+  for (size_t i = 0; i <= len; i++) {
+    if (i == len || pattern[i] == '.') {
+      node = child_node(&trie->pool, node, pattern + start, i - start);
+      start = i + 1;
+    }
+  }
+  /* Earlier patterns take precedence. */
+  if (node->index < 0) {
+    node->index = index;
+  }
+}
+
+static int min_index(int a, int b)
+{
+  if (a < 0) return b;
+  if (b < 0) return a;
+  return a < b ? a : b;
+}
+
+static int match_words(const topic_node *node, const amqp_bytes_t *words,
+                       int count, int i)
+{
+  int result = -1;
+  if (i == count) {
+    result = node->index;
+  } else {
+    const topic_node *elt = node->children;
+    while (elt) {
+      if (elt->word.len == words[i].len &&
+          memcmp(elt->word.bytes, words[i].bytes, words[i].len) == 0) {
+        result = match_words(elt, words, count, i + 1);
+        break;
+      }
+      elt = elt->sibling;
+    }
+    if (node->star) {
+      result = min_index(result, match_words(node->star, words, count, i + 1));
+    }
+  }
+  if (node->hash) {
+    /* "#" can swallow any number of the remaining words, including none. */
+    for (int j = i; j <= count; j++) {
+      result = min_index(result, match_words(node->hash, words, count, j));
+    }
+  }
+  return result;
+}
+
+static void R_finalize_topic_trie(SEXP ptr)
+{
+  topic_trie *trie = (topic_trie *) R_ExternalPtrAddr(ptr);
+  if (trie) {
+    empty_amqp_pool(&trie->pool);
+    free(trie);
+  }
+  R_ClearExternalPtr(ptr);
+}
+
+SEXP R_amqp_compile_topics(SEXP patterns)
+{
+  topic_trie *trie = malloc(sizeof(topic_trie));
+  init_amqp_pool(&trie->pool, 4096);
+  trie->root = new_node(&trie->pool, "", 0);
+
+  SEXP ptr = PROTECT(R_MakeExternalPtr(trie, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(ptr, R_finalize_topic_trie, 1);
+
+  for (int i = 0; i < Rf_length(patterns); i++) {
+    SEXP pattern = STRING_ELT(patterns, i);
+    insert_pattern(trie, CHAR(pattern), XLENGTH(pattern), i);
+  }
+
+  UNPROTECT(1);
+  return ptr;
+}
+
+SEXP R_amqp_match_topic(SEXP ptr, SEXP routing_keys)
+{
+  topic_trie *trie = (topic_trie *) R_ExternalPtrAddr(ptr);
+  if (!trie) {
+    Rf_error("Topic dispatcher is no longer valid.");
+  }
+
+  int n = Rf_length(routing_keys);
+  SEXP out = PROTECT(Rf_allocVector(INTSXP, n));
+  amqp_bytes_t words[MAX_TOPIC_WORDS];
+
+  for (int k = 0; k < n; k++) {
+    SEXP key = STRING_ELT(routing_keys, k);
+    size_t len = XLENGTH(key);
+    if (key == NA_STRING || len > MAX_TOPIC_LEN) {
+      INTEGER(out)[k] = NA_INTEGER;
+      continue;
+    }
+
+    /* Split the routing key into words in place. */
+    const char *bytes = CHAR(key);
+    int count = 0;
+    size_t start = 0;
+    for (size_t i = 0; i <= len; i++) {
+      if (i == len || bytes[i] == '.') {
+        words[count].bytes = (void *) (bytes + start);
+        words[count].len = i - start;
+        count++;
+        start = i + 1;
+      }
+    }
+
+    int index = match_words(trie->root, words, count, 0);
+    INTEGER(out)[k] = index < 0 ? NA_INTEGER : index + 1;
+  }
+
+  UNPROTECT(1);
+  return out;
+}
@@ -1,6 +1,6 @@
 #include <stdio.h> /* for snprintf */
 #include <stdlib.h> /* for malloc, free */
-#include <string.h> /* for strcmp */
+#include <string.h> /* for memcmp */
 #include <Rinternals.h>
 
 #include "constants.h"
@@ -67,8 +67,12 @@ void render_amqp_error(const amqp_rpc_reply_t reply, connection *conn,
     case AMQP_CHANNEL_CLOSE_METHOD: {
       amqp_channel_close_t *method = (amqp_channel_close_t *) reply.reply.decoded;
       snprintf(buffer, len, "%s", (char *) method->reply_text.bytes);
-      // These errors close the channel and require us to open a new one.
-      chan->is_open = 0;
+      // These errors close the channel and require us to open a new one. The
+      // server won't accept the channel ID again until we confirm the close.
+      amqp_channel_close_ok_t close_ok;
+      amqp_send_method(conn->conn, chan->chan, AMQP_CHANNEL_CLOSE_OK_METHOD,
+                       &close_ok);
+      release_channel(conn, chan);
       break;
     }
     default:
@@ -85,7 +89,71 @@ void render_amqp_error(const amqp_rpc_reply_t reply, connection *conn,
   }
 }
 
-void encode_properties(const SEXP list, amqp_basic_properties_t *props)
+int property_flag(const SEXP name)
+{
+  /* Names are compared by address, which works because R caches CHARSXPs. */
+  if (name == content_type_charsxp) {
+    return AMQP_BASIC_CONTENT_TYPE_FLAG;
+  } else if (name == content_encoding_charsxp) {
+    return AMQP_BASIC_CONTENT_ENCODING_FLAG;
+  } else if (name == delivery_mode_charsxp) {
+    return AMQP_BASIC_DELIVERY_MODE_FLAG;
+  } else if (name == priority_charsxp) {
+    return AMQP_BASIC_PRIORITY_FLAG;
+  } else if (name == correlation_id_charsxp) {
+    return AMQP_BASIC_CORRELATION_ID_FLAG;
+  } else if (name == reply_to_charsxp) {
+    return AMQP_BASIC_REPLY_TO_FLAG;
+  } else if (name == expiration_charsxp) {
+    return AMQP_BASIC_EXPIRATION_FLAG;
+  } else if (name == message_id_charsxp) {
+    return AMQP_BASIC_MESSAGE_ID_FLAG;
+  } else if (name == timestamp_charsxp) {
+    return AMQP_BASIC_TIMESTAMP_FLAG;
+  } else if (name == type_charsxp) {
+    return AMQP_BASIC_TYPE_FLAG;
+  } else if (name == user_id_charsxp) {
+    return AMQP_BASIC_USER_ID_FLAG;
+  } else if (name == app_id_charsxp) {
+    return AMQP_BASIC_APP_ID_FLAG;
+  } else if (name == cluster_id_charsxp) {
+    return AMQP_BASIC_CLUSTER_ID_FLAG;
+  }
+  /* Anything else is a header. */
+  return 0;
+}
+
+amqp_bytes_t *property_bytes(amqp_basic_properties_t *props, int flag)
+{
+  switch (flag) {
+  case AMQP_BASIC_CONTENT_TYPE_FLAG:
+    return &props->content_type;
+  case AMQP_BASIC_CONTENT_ENCODING_FLAG:
+    return &props->content_encoding;
+  case AMQP_BASIC_CORRELATION_ID_FLAG:
+    return &props->correlation_id;
+  case AMQP_BASIC_REPLY_TO_FLAG:
+    return &props->reply_to;
+  case AMQP_BASIC_EXPIRATION_FLAG:
+    return &props->expiration;
+  case AMQP_BASIC_MESSAGE_ID_FLAG:
+    return &props->message_id;
+  case AMQP_BASIC_TYPE_FLAG:
+    return &props->type;
+  case AMQP_BASIC_USER_ID_FLAG:
+    return &props->user_id;
+  case AMQP_BASIC_APP_ID_FLAG:
+    return &props->app_id;
+  case AMQP_BASIC_CLUSTER_ID_FLAG:
+    return &props->cluster_id;
+  default:
+    /* Not a string property. */
+    return NULL;
+  }
+}
+
+void encode_properties(const SEXP list, amqp_basic_properties_t *props,
+                       amqp_pool_t *pool)
 {
   props->_flags = 0;
   props->headers.num_entries = 0;
@@ -99,79 +167,46 @@ void encode_properties(const SEXP list, amqp_basic_properties_t *props)
   SEXP names = PROTECT(Rf_getAttrib(list, R_NamesSymbol));
   int headers[max_len];
 
-  int i;
+  int i, flag;
   SEXP elt, name;
+  amqp_bytes_t *field;
   for (i = 0; i < max_len; i++) {
     elt = VECTOR_ELT(list, i);
     name = STRING_ELT(names, i);
+    flag = property_flag(name);
 
-    if (strcmp(CHAR(name), "content_type") == 0) {
-      if (!isString(elt)) Rf_error("'content_type' must be a string.");
-      props->_flags |= AMQP_BASIC_CONTENT_TYPE_FLAG;
-      props->content_type = strsxp_to_amqp_bytes(elt);
-    } else if (strcmp(CHAR(name), "content_encoding") == 0) {
-      if (!isString(elt)) Rf_error("'content_encoding' must be a string.");
-      props->_flags |= AMQP_BASIC_CONTENT_ENCODING_FLAG;
-      props->content_encoding = strsxp_to_amqp_bytes(elt);
-    } else if (strcmp(CHAR(name), "delivery_mode") == 0) {
+    if ((field = property_bytes(props, flag))) {
+      if (!isString(elt)) Rf_error("'%s' must be a string.", CHAR(name));
+      *field = strsxp_to_amqp_bytes(elt);
+    } else if (flag == AMQP_BASIC_DELIVERY_MODE_FLAG) {
       if (!isNumeric(elt)) Rf_error("'delivery_mode' must be an integer.");
-      props->_flags |= AMQP_BASIC_DELIVERY_MODE_FLAG;
       props->delivery_mode = asInteger(elt);
-    } else if (strcmp(CHAR(name), "priority") == 0) {
+    } else if (flag == AMQP_BASIC_PRIORITY_FLAG) {
       if (!isNumeric(elt)) Rf_error("'priority' must be an integer.");
-      props->_flags |= AMQP_BASIC_PRIORITY_FLAG;
       props->priority = asInteger(elt);
-    } else if (strcmp(CHAR(name), "correlation_id") == 0) {
-      if (!isString(elt)) Rf_error("'correlation_id' must be a string.");
-      props->_flags |= AMQP_BASIC_CORRELATION_ID_FLAG;
-      props->correlation_id = strsxp_to_amqp_bytes(elt);
-    } else if (strcmp(CHAR(name), "reply_to") == 0) {
-      if (!isString(elt)) Rf_error("'reply_to' must be a string.");
-      props->_flags |= AMQP_BASIC_REPLY_TO_FLAG;
-      props->reply_to = strsxp_to_amqp_bytes(elt);
-    } else if (strcmp(CHAR(name), "expiration") == 0) {
-      if (!isString(elt)) Rf_error("'expiration' must be a string.");
-      props->_flags |= AMQP_BASIC_EXPIRATION_FLAG;
-      props->expiration = strsxp_to_amqp_bytes(elt);
-    } else if (strcmp(CHAR(name), "message_id") == 0) {
-      if (!isString(elt)) Rf_error("'message_id' must be a string.");
-      props->_flags |= AMQP_BASIC_MESSAGE_ID_FLAG;
-      props->message_id = strsxp_to_amqp_bytes(elt);
-    } else if (strcmp(CHAR(name), "timestamp") == 0) {
-      /* TODO: Support the timestamp. */
-      Rf_warning("The timestamp property is not yet supported, and will be ignored.");
-    } else if (strcmp(CHAR(name), "type") == 0) {
-      if (!isString(elt)) Rf_error("'type' must be a string.");
-      props->_flags |= AMQP_BASIC_TYPE_FLAG;
-      props->type = strsxp_to_amqp_bytes(elt);
-    } else if (strcmp(CHAR(name), "user_id") == 0) {
-      if (!isString(elt)) Rf_error("'user_id' must be a string.");
-      props->_flags |= AMQP_BASIC_USER_ID_FLAG;
-      props->user_id = strsxp_to_amqp_bytes(elt);
-    } else if (strcmp(CHAR(name), "app_id") == 0) {
-      if (!isString(elt)) Rf_error("'app_id' must be a string.");
-      props->_flags |= AMQP_BASIC_APP_ID_FLAG;
-      props->app_id = strsxp_to_amqp_bytes(elt);
-    } else if (strcmp(CHAR(name), "cluster_id") == 0) {
-      if (!isString(elt)) Rf_error("'cluster_id' must be a string.");
-      props->_flags |= AMQP_BASIC_CLUSTER_ID_FLAG;
-      props->cluster_id = strsxp_to_amqp_bytes(elt);
+    } else if (flag == AMQP_BASIC_TIMESTAMP_FLAG) {
+      if (!isNumeric(elt) || asReal(elt) < 0)
+        Rf_error("'timestamp' must be a non-negative number of seconds.");
+      props->timestamp = (uint64_t) asReal(elt);
     } else {
       headers[props->headers.num_entries] = i;
       props->headers.num_entries++;
+      continue;
     }
+    props->_flags |= flag;
   }
 
   if (props->headers.num_entries > 0) {
     props->_flags |= AMQP_BASIC_HEADERS_FLAG;
-    props->headers.entries = calloc(props->headers.num_entries,
-                                    sizeof(amqp_table_entry_t));
+    props->headers.entries = amqp_pool_alloc(
+      pool, props->headers.num_entries * sizeof(amqp_table_entry_t)
+    );
     for (i = 0; i < props->headers.num_entries; i++) {
       elt = VECTOR_ELT(list, headers[i]);
       name = STRING_ELT(names, headers[i]);
 
       props->headers.entries[i].key = charsxp_to_amqp_bytes(name);
-      encode_value(elt, &props->headers.entries[i].value);
+      encode_value(elt, &props->headers.entries[i].value, pool);
     }
   }
 
@@ -179,7 +214,7 @@ void encode_properties(const SEXP list, amqp_basic_properties_t *props)
   return;
 }
 
-SEXP decode_properties(amqp_basic_properties_t *props)
+SEXP decode_properties(amqp_basic_properties_t *props, connection *conn)
 {
   if (!props || props->_flags == 0) {
     return empty_named_list;
@@ -195,7 +230,7 @@ SEXP decode_properties(amqp_basic_properties_t *props)
   SEXP names = PROTECT(Rf_allocVector(STRSXP, flag_count));
 
   if (props->_flags & AMQP_BASIC_HEADERS_FLAG) {
-    SET_VECTOR_ELT(out, index, decode_table(&props->headers));
+    SET_VECTOR_ELT(out, index, decode_table(&props->headers, conn));
     SET_STRING_ELT(names, index, headers_charsxp);
     index++;
   }
@@ -314,19 +349,19 @@ SEXP decode_properties(amqp_basic_properties_t *props)
 
 static void R_finalize_amqp_properties(SEXP ptr)
 {
-  amqp_basic_properties_t *props = (amqp_basic_properties_t *) R_ExternalPtrAddr(ptr);
+  encoded_properties *props = (encoded_properties *) R_ExternalPtrAddr(ptr);
   if (props) {
-    if (props->headers.num_entries > 0) {
-      free(props->headers.entries);
-    }
+    /* Everything the properties refer to lives in the pool. */
+    empty_amqp_pool(&props->pool);
     free(props);
   }
   R_ClearExternalPtr(ptr);
 }
 
-SEXP R_properties_object(amqp_basic_properties_t *props)
+SEXP R_properties_object(encoded_properties *props, SEXP list)
 {
-  SEXP ptr = PROTECT(R_MakeExternalPtr(props, R_NilValue, R_NilValue));
+  /* Strings in the properties point into the list, so keep it alive, too. */
+  SEXP ptr = PROTECT(R_MakeExternalPtr(props, R_NilValue, list));
   R_RegisterCFinalizerEx(ptr, R_finalize_amqp_properties, 1);
 
   /* Create the "amqp_properties" object. */
@@ -344,9 +379,17 @@ SEXP R_amqp_encode_properties(SEXP list)
   if (Rf_xlength(list) == 0) {
     return empty_properties_object;
   }
-  amqp_basic_properties_t *props = malloc(sizeof(amqp_basic_properties_t));
-  encode_properties(list, props);
-  return R_properties_object(props);
+  encoded_properties *props = malloc(sizeof(encoded_properties));
+  init_amqp_pool(&props->pool, ENCODING_POOL_PAGESIZE);
+  props->props._flags = 0;
+  props->props.headers.num_entries = 0;
+
+  /* Wrap the properties before encoding them, so that the memory is still
+     reclaimed if encoding fails. */
+  SEXP out = PROTECT(R_properties_object(props, list));
+  encode_properties(list, &props->props, &props->pool);
+  UNPROTECT(1);
+  return out;
 }
 
 SEXP R_amqp_decode_properties(SEXP ptr)
@@ -354,25 +397,26 @@ SEXP R_amqp_decode_properties(SEXP ptr)
   amqp_basic_properties_t *props = (amqp_basic_properties_t *) R_ExternalPtrAddr(ptr);
   if (!props)
     Rf_error("Properties object is no longer valid.");
-  return decode_properties(props);
+  return decode_properties(props, NULL);
 }
 
-SEXP R_message_object(SEXP body, int delivery_tag, int redelivered,
+SEXP R_message_object(SEXP body, uint64_t delivery_tag, int redelivered,
                       amqp_bytes_t exchange, amqp_bytes_t routing_key,
                       int message_count, amqp_bytes_t consumer_tag,
-                      amqp_basic_properties_t *props)
+                      amqp_basic_properties_t *props, connection *conn)
 {
   SEXP out = PROTECT(Rf_allocVector(VECSXP, 7));
   SET_VECTOR_ELT(out, 0, body);
-  SET_VECTOR_ELT(out, 1, ScalarInteger(delivery_tag));
+  /* Delivery tags are 64-bit, so they do not fit in an R integer. */
+  SET_VECTOR_ELT(out, 1, ScalarReal((double) delivery_tag));
   SET_VECTOR_ELT(out, 2, ScalarLogical(redelivered));
-  SET_VECTOR_ELT(out, 3, amqp_bytes_to_string(&exchange));
-  SET_VECTOR_ELT(out, 4, amqp_bytes_to_string(&routing_key));
-  SET_VECTOR_ELT(out, 6, decode_properties(props));
+  SET_VECTOR_ELT(out, 3, cached_string(conn, &exchange));
+  SET_VECTOR_ELT(out, 4, cached_string(conn, &routing_key));
+  SET_VECTOR_ELT(out, 6, decode_properties(props, conn));
 
   /* amqp_get and amqp_consume will have different entries. */
   if (message_count < 0) {
-    SET_VECTOR_ELT(out, 5, amqp_bytes_to_string(&consumer_tag));
+    SET_VECTOR_ELT(out, 5, cached_string(conn, &consumer_tag));
     Rf_setAttrib(out, R_NamesSymbol, message_names_consume);
   } else {
     SET_VECTOR_ELT(out, 5, ScalarInteger(message_count));
@@ -395,6 +439,57 @@ SEXP amqp_bytes_to_char(const amqp_bytes_t *in)
   return mkCharLen(in->bytes, in->len);
 }
 
+/* Strings that are too long to be worth caching. */
+#define STRING_CACHE_MAX_LEN 255
+
+static size_t string_cache_slot(const amqp_bytes_t *in)
+{
+  /* FNV-1a. */
+  uint32_t hash = 2166136261u;
+  const unsigned char *bytes = (const unsigned char *) in->bytes;
+  for (size_t i = 0; i < in->len; i++) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return hash & (STRING_CACHE_SIZE - 1);
+}
+
+SEXP cached_string(connection *conn, const amqp_bytes_t *in)
+{
+  /* Exchanges, routing keys, consumer tags, and header keys tend to come from
+     a small set, so we keep the most recent in a direct-mapped cache rather
+     than allocating and going through R's global CHARSXP table each time. */
+  if (!conn || !conn->strings || in->len > STRING_CACHE_MAX_LEN) {
+    return amqp_bytes_to_string(in);
+  }
+
+  size_t slot = string_cache_slot(in);
+  SEXP out = VECTOR_ELT(conn->strings, slot);
+  if (out != R_NilValue) {
+    SEXP str = STRING_ELT(out, 0);
+    if ((size_t) XLENGTH(str) == in->len &&
+        memcmp(CHAR(str), in->bytes, in->len) == 0) {
+      return out;
+    }
+  }
+
+  out = PROTECT(amqp_bytes_to_string(in));
+  /* The same vector is handed out many times, so it must be copied on
+     modification. */
+  MARK_NOT_MUTABLE(out);
+  SET_VECTOR_ELT(conn->strings, slot, out);
+  UNPROTECT(1);
+  return out;
+}
+
+SEXP cached_char(connection *conn, const amqp_bytes_t *in)
+{
+  if (!conn || !conn->strings || in->len > STRING_CACHE_MAX_LEN) {
+    return amqp_bytes_to_char(in);
+  }
+  return STRING_ELT(cached_string(conn, in), 0);
+}
+
 amqp_bytes_t charsxp_to_amqp_bytes(const SEXP in)
 {
   /* Assume we have a CHARSXP */
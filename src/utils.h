@@ -3,6 +3,7 @@
 
 #include <amqp.h>       /* for amqp_rpc_reply_t */
 #include "connection.h" /* for connection, channel */
+#include "tables.h"     /* for encoded_properties */
 
 #ifdef __cplusplus
 extern "C" {
@@ -12,15 +13,20 @@ void render_amqp_library_error(int err, connection *conn, channel *chan,
                                char *buffer, size_t len);
 void render_amqp_error(const amqp_rpc_reply_t reply, connection *conn,
                        channel *chan, char *err_buffer, size_t buffer_len);
-SEXP R_properties_object(amqp_basic_properties_t *props);
-SEXP R_message_object(SEXP body, int delivery_tag, int redelivered,
+SEXP R_properties_object(encoded_properties *props, SEXP list);
+SEXP decode_properties(amqp_basic_properties_t *props, connection *conn);
+SEXP R_message_object(SEXP body, uint64_t delivery_tag, int redelivered,
                       amqp_bytes_t exchange, amqp_bytes_t routing_key,
                       int message_count, amqp_bytes_t consumer_tag,
-                      amqp_basic_properties_t *props);
+                      amqp_basic_properties_t *props, connection *conn);
 SEXP amqp_bytes_to_string(const amqp_bytes_t *in);
 SEXP amqp_bytes_to_char(const amqp_bytes_t *in);
+SEXP cached_string(connection *conn, const amqp_bytes_t *in);
+SEXP cached_char(connection *conn, const amqp_bytes_t *in);
 amqp_bytes_t charsxp_to_amqp_bytes(const SEXP in);
 amqp_bytes_t strsxp_to_amqp_bytes(const SEXP in);
+int property_flag(const SEXP name);
+amqp_bytes_t *property_bytes(amqp_basic_properties_t *props, int flag);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,133 @@
+#include <pthread.h>
+#include <stdlib.h> /* for malloc, free */
+#include <string.h> /* for memcmp, memcpy */
+
+#include <Rinternals.h>
+#include <amqp.h>
+
+#include <longears_api.h>
+
+/* Helpers used only by the package's tests, to exercise the C API the way
+   another package would: through the functions registered with
+   R_RegisterCCallable(). These are compiled by helpers-native.R rather than
+   shipped with the package. */
+
+typedef struct test_handler {
+  pthread_mutex_t mutex;
+  int handled;
+  int forwarded;
+} test_handler;
+
+/* Handles messages with the body "native" and forwards everything else. */
+static int test_message_handler(const amqp_envelope_t *env, void *data)
+{
+  test_handler *counts = (test_handler *) data;
+  int handled = env->message.body.len == 6 &&
+    memcmp(env->message.body.bytes, "native", 6) == 0;
+  pthread_mutex_lock(&counts->mutex);
+  if (handled) {
+    counts->handled++;
+  } else {
+    counts->forwarded++;
+  }
+  pthread_mutex_unlock(&counts->mutex);
+  return handled ? 0 : 1;
+}
+
+static void R_finalize_test_handler(SEXP ptr)
+{
+  test_handler *counts = (test_handler *) R_ExternalPtrAddr(ptr);
+  if (counts) {
+    pthread_mutex_destroy(&counts->mutex);
+    free(counts);
+  }
+  R_ClearExternalPtr(ptr);
+}
+
+/* The counts are owned by R rather than the consumer, so callers must keep
+   the returned object alive for as long as the handler is attached. */
+SEXP test_native_handler(SEXP consumer)
+{
+  test_handler *counts = malloc(sizeof(test_handler));
+  pthread_mutex_init(&counts->mutex, NULL);
+  counts->handled = 0;
+  counts->forwarded = 0;
+  SEXP ptr = PROTECT(R_MakeExternalPtr(counts, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(ptr, R_finalize_test_handler, 1);
+
+  if (longears_set_native_handler(consumer, test_message_handler, counts,
+                                  NULL) < 0) {
+    UNPROTECT(1);
+    Rf_error("Failed to attach a native handler.");
+  }
+
+  UNPROTECT(1);
+  return ptr;
+}
+
+SEXP test_handler_counts(SEXP ptr)
+{
+  test_handler *counts = (test_handler *) R_ExternalPtrAddr(ptr);
+  if (!counts) {
+    Rf_error("Invalid test handler.");
+  }
+
+  SEXP out = PROTECT(Rf_allocVector(INTSXP, 2));
+  SEXP names = PROTECT(Rf_allocVector(STRSXP, 2));
+  pthread_mutex_lock(&counts->mutex);
+  INTEGER(out)[0] = counts->handled;
+  INTEGER(out)[1] = counts->forwarded;
+  pthread_mutex_unlock(&counts->mutex);
+  SET_STRING_ELT(names, 0, Rf_mkChar("handled"));
+  SET_STRING_ELT(names, 1, Rf_mkChar("forwarded"));
+  Rf_setAttrib(out, R_NamesSymbol, names);
+
+  UNPROTECT(2);
+  return out;
+}
+
+/* Publish a message to a queue, get it back, and then ack it (or nack and
+   requeue it), all through the C API. Returns the message body. */
+SEXP test_api_roundtrip(SEXP conn, SEXP queue, SEXP body, SEXP ack)
+{
+  longears_connection *lconn = longears_get_connection(conn);
+  if (!lconn) {
+    Rf_error("Invalid connection object.");
+  }
+  amqp_bytes_t queue_str = amqp_cstring_bytes(CHAR(Rf_asChar(queue)));
+  amqp_bytes_t body_str;
+  body_str.len = XLENGTH(body);
+  body_str.bytes = (void *) RAW(body);
+
+  char errbuff[200];
+  if (longears_publish(lconn, amqp_empty_bytes, queue_str, body_str, 0, 0,
+                       NULL, errbuff, 200) < 0) {
+    Rf_error("Failed to publish message. %s", errbuff);
+  }
+
+  amqp_envelope_t env;
+  int res = longears_get(lconn, queue_str, 0, &env, errbuff, 200);
+  if (res < 0) {
+    Rf_error("Failed to get message. %s", errbuff);
+  } else if (res == 0) {
+    return R_NilValue;
+  }
+
+  SEXP out = PROTECT(Rf_allocVector(RAWSXP, env.message.body.len));
+  memcpy(RAW(out), env.message.body.bytes, env.message.body.len);
+  uint64_t delivery_tag = env.delivery_tag;
+  amqp_destroy_envelope(&env);
+
+  if (asLogical(ack) == 1) {
+    res = longears_ack(lconn, delivery_tag, 0, errbuff, 200);
+  } else {
+    res = longears_nack(lconn, delivery_tag, 0, 1, errbuff, 200);
+  }
+  if (res < 0) {
+    UNPROTECT(1);
+    Rf_error("Failed to settle message. %s", errbuff);
+  }
+
+  UNPROTECT(1);
+  return out;
+}